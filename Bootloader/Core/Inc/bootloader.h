@@ -18,7 +18,20 @@ typedef enum
 	BL_STATE_EXECUTE,
 	BL_STATE_ERASE_APP,
 	BL_STATE_SEND_ERROR,
-	BL_STATE_DOWNLOAD_FW
+	BL_STATE_DOWNLOAD_FW,
+	BL_STATE_DOWNLOAD_WIN,
+	BL_STATE_OPEN_SESSION,
+	BL_STATE_SEND_STATS,
+	BL_STATE_CHECKSUM,
+	BL_STATE_CHECKSUM_WAIT,
+	BL_STATE_VERIFY_APP,
+	BL_STATE_RECEIVE_WIN,
+	BL_STATE_ERASE_WAIT,
+	BL_STATE_BLOCK_HASH,
+	BL_STATE_BLOCK_HASH_SEND,
+	BL_STATE_IMAGE_INFO,
+	BL_STATE_UPLOAD,
+	BL_STATE_UPLOAD_SEND
 
 } e_Bootloader_State;
 
@@ -26,12 +39,16 @@ typedef enum
 typedef enum
 {
 	BL_OK						= 0,			// Bootloader operation successful
+	BL_BUSY,									// Operation in progress, more work is ready
+	BL_WAITING,									// Operation in progress, waiting for the host
 	BL_CHKS_MISMATCH			= 0x7F, 		// Application checksum incorrect
 	BL_CMD_INVALID,								// Invalid command
 	BL_INVALID_STATE,							// Invalid state
 	BL_RECEIVE_TIMEOUT,							// Receive timeout reached
 	BL_DOWNLOAD_FAILED,							// Firmware download failed
-	BL_NO_USER_APP								// No user application found
+	BL_NO_USER_APP,								// No user application found
+	BL_VERIFY_FAILED,							// Programmed data doesn't match after writing
+	BL_DELTA_SOURCE_LOST						// A patch copies data the download has already overwritten
 
 } e_Bootloader_Status;
 
@@ -45,7 +62,23 @@ typedef enum
 	CMD_ID_ERROR			= 0x50,				// Command ID: Error
 	CMD_ID_EXECUTE			= 0x60,				// Command ID: Execute
 	CMD_ID_ERASE_APP		= 0x70,				// Command ID: Erase Application
-	CMD_ID_DOWNLOAD_FW		= 0x80				// Command ID: Download Firmware
+	CMD_ID_DOWNLOAD_FW		= 0x80,				// Command ID: Download Firmware
+	CMD_ID_DOWNLOAD_WIN		= 0x90,				// Command ID: Download Firmware (sliding window, selective repeat)
+	CMD_ID_WIN_ACK			= 0x91,				// Command ID: Window Acknowledge (cumulative + bitmap)
+	CMD_ID_DOWNLOAD_SEG		= 0x92,				// Command ID: Download Firmware Segments (windowed, frames tagged with their block)
+	CMD_ID_DOWNLOAD_SYNC	= 0x93,				// Command ID: Download Changed Blocks (segmented, the blocks not sent are kept)
+	CMD_ID_DELTA_NACK		= 0x94,				// Command ID: Patch Source Lost (send the frame again unpatched)
+	CMD_ID_SESSION			= 0xA0,				// Command ID: Open Session (negotiate the frame size)
+	CMD_ID_SESSION_INFO		= 0xA1,				// Command ID: Session Information
+	CMD_ID_GET_STATS		= 0xB0,				// Command ID: Get Performance Counters
+	CMD_ID_STATS			= 0xB1,				// Command ID: Performance Counters
+	CMD_ID_CHECKSUM			= 0xC0,				// Command ID: Compute the Checksum of the Application Area
+	CMD_ID_CHECKSUM_INFO	= 0xC1,				// Command ID: Checksum Result
+	CMD_ID_BLOCK_HASH		= 0xC2,				// Command ID: Compute the Checksum of each Block of the Application Area
+	CMD_ID_BLOCK_HASH_INFO	= 0xC3,				// Command ID: Block Checksums
+	CMD_ID_GET_IMAGE_INFO	= 0xC4,				// Command ID: Get the Length and Checksum of the Installed Image
+	CMD_ID_IMAGE_INFO		= 0xC5,				// Command ID: Installed Image Information
+	CMD_ID_UPLOAD			= 0xD0				// Command ID: Upload a Flash Range (read back)
 
 } e_Bootloader_CMD_ID;
 
@@ -53,10 +86,17 @@ typedef enum
 /* Functions --------------------------------------------------------------*/
 
 void Bootloader_Run(void);
+bool Bootloader_Task(void);
 void Bootloader_JumToApplication(void);
 bool Bootloader_CheckApplicationExist(void);
 uint8_t Bootloader_EraseApplication(void);
+void Bootloader_StartEraseApplication(void);
+uint8_t Bootloader_EraseAppSector(uint8_t sector);
+uint8_t Bootloader_PrepareFlash(uint32_t address, uint32_t size);
 uint8_t Bootloader_DownloadFW(uint16_t total_packets);
+uint8_t Bootloader_StartDownloadWindowed(uint16_t total_frames, uint16_t frame_size, uint32_t app_checksum, bool segmented, bool keep_blocks);
+uint8_t Bootloader_StepDownloadWindowed(uint32_t *image_size);
+uint8_t Bootloader_ProgramStaged(uint32_t address, uint32_t size, const uint32_t *crc);
 uint8_t Bootloader_VerifyAppChecksum(uint32_t app_checksum, uint32_t app_word_size);
 
 #endif /* __BOOTLOADER_H */
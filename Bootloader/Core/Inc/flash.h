@@ -4,6 +4,8 @@
 
 /* Includes --------------------------------------------------------------*/
 
+#include <stdbool.h>
+#include <stdint.h>
 
 
 /* Macro definitions --------------------------------------------------------------*/
@@ -42,6 +44,15 @@
 #define APP_END_ADDRESS 			(uint32_t)0x08080000
 #define APP_START_SECTOR			4									// Sector 4
 
+// CRC
+#define CRC_POLYNOMIAL				(uint32_t)0x04C11DB7				// CRC-32 polynomial of the CRC unit
+#define CRC_INITIAL_VALUE			(uint32_t)0xFFFFFFFF				// CRC unit value after a reset
+#define CRC_DMA_MAX_WORDS			(uint32_t)0xFFFF					// Words per DMA transfer, longer areas are fed in several transfers
+
+// ASYNCHRONOUS JOBS
+#define FLASH_JOB_QUEUE_SIZE		8									// Erase jobs waiting for the flash
+#define FLASH_IRQ_PRIORITY			1									// Below the USB and DMA interrupts
+
 // RAM
 #define RAM_BASE_ADDRESS			(uint32_t)0x20000000
 #define RAM_END_ADDRESS				(uint32_t)0x20020000
@@ -62,17 +73,47 @@ typedef enum
     FLASH_READ_OVER_ERROR,          /*!< Flash read exceeds address range */
     FLASH_WRITE_OVER_ERROR,         /*!< Flash write exceeds address range */
     FLASH_WRITE_CORR_ERROR,         /*!< Flash write incorrect */
+    FLASH_CRC_BUSY,                 /*!< A DMA fed checksum is still running */
+    FLASH_CRC_ERROR,                /*!< The DMA fed checksum failed */
+    FLASH_JOB_QUEUE_FULL,           /*!< No room left in the job queue */
 
 } e_Flash_Status;
 
 
+/* Typedef --------------------------------------------------------------*/
+
+/**
+ * @brief  Completion callback of an asynchronous flash job, called from the flash interrupt.
+ *         status: e_Flash_Status of the job.
+ *         target: The sector erased.
+ */
+typedef void (*pFlash_Callback)(uint8_t status, uint32_t target);
+
+
 /* Functions -----------------------------------------------------------------*/
 
 uint8_t Flash_Init(void);
+uint8_t Flash_Open(void);
+void Flash_Close(void);
 uint8_t Flash_EraseSector(uint8_t sector);
+uint8_t Flash_GetSector(uint32_t address);
+uint32_t Flash_GetSectorAddress(uint8_t sector);
+bool Flash_IsBlank(uint32_t address, uint32_t size);
+bool Flash_IsSectorBlank(uint8_t sector);
+uint8_t Flash_CheckRead(uint32_t address, uint32_t size);
 uint8_t Flash_Read_Word(uint32_t address, uint32_t *data, uint32_t size);
+uint8_t Flash_Read(uint32_t address, uint8_t *data, uint32_t length);
 uint8_t Flash_Write_Word(uint32_t address, uint32_t *data, uint32_t size);
+uint8_t Flash_Program_Burst(uint32_t address, const uint32_t *data, uint32_t size);
 uint32_t Flash_GetChecksum(uint32_t start_address, uint32_t size);
+uint32_t Flash_ResumeChecksum(uint32_t checksum, uint32_t start_address, uint32_t size);
+uint8_t Flash_StartChecksumDMA(uint32_t start_address, uint32_t size);
+uint8_t Flash_GetChecksumDMA(uint32_t *checksum);
+
+// Asynchronous jobs
+uint8_t Flash_QueueErase(uint8_t sector, pFlash_Callback callback);
+bool Flash_IsBusy(void);
+void Flash_JobIRQHandler(void);
 
 
 #endif /* __FLASH_H */
@@ -0,0 +1,101 @@
+
+#ifndef __PERF_H
+#define __PERF_H
+
+
+/* Includes --------------------------------------------------------------*/
+
+#include "stm32f4xx_hal.h"
+
+
+/* Enumerations --------------------------------------------------------------*/
+
+/**
+ * @brief  Performance counters reported to the host by the GET_STATS command.
+ *         The order is part of the protocol, new counters are appended at the end.
+ */
+typedef enum
+{
+    PERF_CORE_CLOCK_HZ = 0,         /*!< Core clock, converts the cycle counters to time */
+    PERF_DOWNLOAD_CYCLES,           /*!< Cycles from the download command to the last frame committed */
+    PERF_RECEIVE_CYCLES,            /*!< Cycles spent moving and checking frames from the receive ring */
+    PERF_PROGRAM_CYCLES,            /*!< Cycles spent programming the flash */
+    PERF_PROGRAM_OVERLAP_CYCLES,    /*!< Programming cycles while the next frame was being received */
+    PERF_WAIT_CYCLES,               /*!< Cycles with nothing to receive nor to program */
+    PERF_FRAMES,                    /*!< Frames committed to flash */
+    PERF_ERASE_CYCLES,              /*!< Cycles spent erasing flash sectors */
+    PERF_ERASED_SECTORS,            /*!< Bitmap of the sectors erased, bit n for sector n */
+    PERF_BLANK_CHECK_CYCLES,        /*!< Cycles spent checking whether sectors are already erased */
+    PERF_ERASES_SKIPPED,            /*!< Sector erases skipped because the sector was already blank */
+    PERF_PROGRAMMED_WORDS,          /*!< Words programmed into the flash */
+    PERF_VERIFY_CYCLES,             /*!< Cycles spent verifying the programmed blocks */
+    PERF_TAIL_CYCLES,               /*!< Cycles from the last frame acknowledged to the final checksum verified */
+    PERF_CHECKSUM_CYCLES,           /*!< Cycles of the last CHECKSUM command */
+    PERF_CHECKSUM_POLLS,            /*!< State machine passes while a DMA fed checksum was running */
+    PERF_RING_COPY_CYCLES,          /*!< Cycles spent copying data out of the receive ring */
+    PERF_RING_COPY_BYTES,           /*!< Bytes copied out of the receive ring */
+    PERF_RX_STALL_CYCLES,           /*!< Cycles the OUT endpoint was held off because the receive ring was nearly full */
+    PERF_RX_STALLS,                 /*!< Times the receive ring was nearly full and the OUT endpoint was held off */
+    PERF_RX_HIGH_WATER,             /*!< Most bytes held by the receive ring */
+    PERF_RX_ISR_CYCLES,             /*!< Cycles spent storing the received packets, in the USB interrupt */
+    PERF_USB_IRQS,                  /*!< USB interrupts serviced */
+    PERF_RX_TRANSFERS,              /*!< OUT transfers completed, each one costs a receive callback */
+    PERF_TX_MESSAGES,               /*!< Messages queued for the host */
+    PERF_TX_DROPPED,                /*!< Messages dropped because the transmit queue stayed full */
+    PERF_TX_TRANSFERS,              /*!< IN transfers, each one sends the messages queued meanwhile */
+    PERF_TX_PACKETS,                /*!< IN packets sent, zero length packets included */
+    PERF_SLEEP_CYCLES,              /*!< Cycles the CPU slept in WFI, no task having work ready */
+    PERF_TASK_STEPS,                /*!< Task steps run by the scheduler */
+    PERF_FLASH_JOBS,                /*!< Asynchronous flash jobs completed */
+    PERF_FLASH_JOB_CYCLES,          /*!< Cycles the asynchronous flash jobs kept the flash busy */
+    PERF_TICK_LATENCY_MAX,          /*!< Longest delay of the tick interrupt, how long the interrupts were held off */
+    PERF_INFLATE_CYCLES,            /*!< Cycles spent decompressing the compressed frames */
+    PERF_INFLATED_BYTES,            /*!< Bytes output by the decompression of the compressed frames */
+    PERF_DELTA_COPY_BYTES,          /*!< Bytes the patched frames copied from the installed application */
+    PERF_KEPT_BYTES,                /*!< Bytes a sync download programmed back from the RAM copy of their sector */
+    PERF_TX_IDLE,                   /*!< IN transfers completed with nothing queued after them, the endpoint idles */
+    PERF_UPLOAD_BYTES,              /*!< Bytes of flash uploaded to the host */
+
+    PERF_COUNT
+
+} e_Perf_Counter;
+
+
+/* Variables -----------------------------------------------------------------*/
+
+extern uint32_t perf_counters[PERF_COUNT];
+
+
+/* Functions -----------------------------------------------------------------*/
+
+void Perf_Init(void);
+void Perf_Reset(void);
+void Perf_Tick(void);
+
+/**
+ * @brief	Read the free running cycle counter.
+ * @param	None
+ * @return	The current cycle count.
+ */
+static inline uint32_t Perf_GetCycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+/**
+ * @brief	Add the cycles elapsed since a start point to a counter.
+ * @param	counter: The counter to update.
+ * @param	start: The cycle count at the start point.
+ * @return	The current cycle count, usable as the next start point.
+ */
+static inline uint32_t Perf_AddCycles(e_Perf_Counter counter, uint32_t start)
+{
+	uint32_t now = DWT->CYCCNT;
+
+	perf_counters[counter] += now - start;
+
+	return now;
+}
+
+
+#endif /* __PERF_H */
@@ -0,0 +1,49 @@
+
+#ifndef __RING_H
+#define __RING_H
+
+
+/* Includes --------------------------------------------------------------*/
+
+#include <stdint.h>
+
+
+/* Typedef --------------------------------------------------------------*/
+
+/**
+ * @brief  Single producer / single consumer byte ring.
+ *         The size is a power of two and the indexes run freely, masked on access, so the
+ *         whole buffer is usable and no division is needed. The producer only writes the
+ *         head and the consumer only writes the tail: one side may run in an interrupt
+ *         without any lock.
+ */
+typedef struct
+{
+	uint8_t *buffer;				/*!< Storage of the ring */
+	uint32_t mask;					/*!< Size of the storage minus one */
+	volatile uint32_t head;			/*!< Free running write index, written by the producer only */
+	volatile uint32_t tail;			/*!< Free running read index, written by the consumer only */
+
+} s_Ring;
+
+
+/* Functions -----------------------------------------------------------------*/
+
+void Ring_Init(s_Ring *ring, uint8_t *buffer, uint32_t size);
+uint32_t Ring_Used(const s_Ring *ring);
+uint32_t Ring_Free(const s_Ring *ring);
+
+// Producer side
+uint32_t Ring_Write(s_Ring *ring, const uint8_t *data, uint32_t length);
+uint32_t Ring_PeekWrite(s_Ring *ring, uint8_t **data);
+void Ring_CommitWrite(s_Ring *ring, uint32_t length);
+void Ring_Truncate(s_Ring *ring, uint32_t length);
+
+// Consumer side
+uint32_t Ring_Read(s_Ring *ring, uint8_t *data, uint32_t length);
+uint32_t Ring_PeekRead(s_Ring *ring, const uint8_t **data);
+void Ring_CommitRead(s_Ring *ring, uint32_t length);
+void Ring_Flush(s_Ring *ring);
+
+
+#endif /* __RING_H */
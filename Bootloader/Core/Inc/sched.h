@@ -0,0 +1,50 @@
+
+#ifndef __SCHED_H
+#define __SCHED_H
+
+
+/* Includes --------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/* Macro Definition --------------------------------------------------------------*/
+
+#define SCHED_MAX_TASKS			4								// Size of the task table
+
+
+/* Enumerations --------------------------------------------------------------*/
+
+/**
+ * @brief  Events posted by the interrupts to wake the tasks waiting for them.
+ */
+typedef enum
+{
+	SCHED_EVENT_RX			= 0x01,			/*!< Data received from the host */
+	SCHED_EVENT_TX			= 0x02,			/*!< A transfer to the host is completed */
+	SCHED_EVENT_DMA			= 0x04,			/*!< A DMA fed checksum is completed */
+	SCHED_EVENT_TICK		= 0x08,			/*!< The millisecond tick, drives the timeouts */
+	SCHED_EVENT_FLASH		= 0x10			/*!< An asynchronous flash job is completed */
+
+} e_Sched_Event;
+
+
+/* Typedef --------------------------------------------------------------*/
+
+/**
+ * @brief  A task runs one step of its state machine and returns without waiting.
+ *         It returns true if it has more work ready, false to wait for one of its events.
+ */
+typedef bool (*pTask)(void);
+
+
+/* Functions -----------------------------------------------------------------*/
+
+void Sched_Init(void);
+bool Sched_AddTask(pTask task, uint32_t events);
+void Sched_Post(uint32_t events);
+void Sched_Run(void);
+
+
+#endif /* __SCHED_H */
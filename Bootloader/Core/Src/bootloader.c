@@ -1,6 +1,7 @@
 
 /* Includes --------------------------------------------------------------*/
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,21 +9,155 @@
 #include "bootloader.h"
 #include "usbd_cdc_if.h"
 #include "flash.h"
+#include "perf.h"
+#include "sched.h"
 
 
 /* Macro Definition --------------------------------------------------------------*/
 
 #define MAX_TIMEOUT				(uint32_t)0xFFFFFFFF			// Maximum timeout value (infinite)
 #define NO_TIMEOUT				(uint32_t)0x00					// Disable timeout
+#define TX_DONE_TIMEOUT			(uint32_t)100					// Time given to the last response to reach the host, in ms
+#define UPLOAD_TIMEOUT			(uint32_t)2000					// Time given to the host to read more of an upload, in ms
 
 #define CMD_PACKET_SIZE			7								// Size of the command packet
 #define CMD_RESP_PACKET_SIZE	3								// Size of the command response packet
 
+#define FRAME_HEADER_SIZE		12								// Frame header: ID, flags, sequence number (2), length (2), block (2), CRC (4)
+#define FRAME_MIN_SIZE			64								// Default frame size, also the frame size granularity
+#define FRAME_MAX_SIZE			4096							// Largest frame payload the bootloader accepts
+#define FRAME_BLOCK_ALIGN		64								// Zero-copy frames are padded to a multiple of the USB packet size
+#define FRAME_BLOCK_SIZE(size)	((FRAME_HEADER_SIZE + (size) + FRAME_BLOCK_ALIGN - 1) & ~(FRAME_BLOCK_ALIGN - 1))
+#define FRAME_FLAG_COMPRESSED	0x80							// The frame payload is LZSS compressed
+#define FRAME_FLAG_DELTA		0x40							// The frame payload is a patch against the installed application
+#define FRAME_FLAG_FILL			0x20							// A filler word follows the payload, outside its length and CRC
+#define FRAME_FLAG_PAD_MASK		0x03							// Bytes padding a compressed or patch payload to a whole word
+#define FRAME_FILL_SIZE			4								// Filler sent when the frame would otherwise end on a USB packet boundary
+#define DELTA_OP_COPY			0x01							// Patch operation: length (2), offset in the application area (4)
+#define DELTA_OP_INSERT			0x02							// Patch operation: length (2), then the bytes
+#define LZSS_MIN_MATCH			3								// Shortest match, encoded as length 0
+#define WIN_ACK_PACKET_SIZE		7								// Size of the window acknowledgment: ID, base (2), bitmap (4)
+#define WIN_MAX_SIZE			32								// Maximum frames in flight, bounded by the acknowledgment bitmap
+#define SESSION_INFO_PACKET_SIZE 7								// Size of the session info: ID, frame size (2), window (1), flags (1), staging size in KB (2)
+#define CHECKSUM_PACKET_SIZE	7								// Size of the checksum result: ID, checksum (4), reserved (2)
+#define CHECKSUM_ENGINE_CPU		0								// The CPU feeds the CRC unit
+#define CHECKSUM_ENGINE_DMA		1								// The DMA feeds the CRC unit, the state machine keeps running
+#define BLOCK_HASH_BATCH		32								// Block checksums computed and queued per step at most
+#define IMAGE_INFO_PACKET_SIZE	9								// Size of the image information: ID, length (4), checksum (4)
+#define WIN_MAX_TIMEOUTS		3								// Consecutive receive timeouts before aborting the download
+#define PIPELINE_SLOTS			2								// Frame buffers: one fills from the receive ring while another is programmed
+#define PROGRAM_STEP_WORDS		16								// Words programmed before servicing the receive ring again
+#ifdef BL_RAM_HOTPATH
+#define STAGING_SIZE			(32 * 1024)						// RAM staging area of the store-and-forward mode, shared with the hot path code
+#else
+#define STAGING_SIZE			(64 * 1024)						// RAM staging area of the store-and-forward mode
+#endif
+#define ERASE_TRIES				3								// Attempts to erase a sector before giving up
+#define KEPT_BLOCKS_WORDS		((STAGING_SIZE / FRAME_MIN_SIZE / 32) + 1)	// Bitmap of the blocks of a kept sector, one more for a block across its start
+
+// Session flags, negotiated by the SESSION command
+#define SESSION_FLAG_STAGED		0x01							// Store-and-forward: stage the image in RAM, erase and program once verified
+#define SESSION_FLAG_HAL_PROGRAM	0x02							// Program word by word through the HAL instead of the burst engine
+#define SESSION_FLAG_REREAD		0x10							// Re-read the whole image for the final checksum
+#define SESSION_FLAG_ZERO_COPY	0x20							// Receive the padded frames in place into the pipeline slots, bypassing the receive ring
+#define SESSION_FLAG_SINGLE_PACKET	0x40						// Arm the OUT endpoint packet by packet instead of RX_TRANSFER_SIZE at once
+#define SESSION_VERIFY_MASK		0x0C							// Verify policy of the programmed blocks
+#define SESSION_VERIFY_CRC		0x00							// CRC of the block in flash against the CRC sent with it (default)
+#define SESSION_VERIFY_NONE		0x04							// No verification, the image checksum is still checked at the end
+#define SESSION_VERIFY_READBACK	0x08							// Read back and compare every word of the block
+#define SESSION_FLAGS_SUPPORTED	(SESSION_FLAG_STAGED | SESSION_FLAG_HAL_PROGRAM | SESSION_VERIFY_MASK | SESSION_FLAG_REREAD | SESSION_FLAG_ZERO_COPY | \
+									 SESSION_FLAG_SINGLE_PACKET)
+
+#define IMAGE_CHECKSUM_REREAD	0								// Set to 1 to always re-read the whole image for the final checksum
+#define VECTOR_TABLE_SIZE		(16 + SPI5_IRQn + 1)			// Words of the vector table: the core exceptions then the interrupts
+
+
+/* Typedef --------------------------------------------------------------*/
+
+typedef enum
+{
+	SLOT_FREE,
+	SLOT_FILLING,
+	SLOT_READY,
+	SLOT_DROPPED												// Zero-copy frame rejected, the slot is queued again in its turn
+
+} e_Slot_State;
+
+
+typedef struct
+{
+	uint8_t header[FRAME_HEADER_SIZE];							// Frame header, received here in zero-copy mode only
+	uint32_t data[FRAME_MAX_SIZE / 4];							// Frame payload, word aligned for programming
+	uint8_t padding[FRAME_BLOCK_SIZE(FRAME_MAX_SIZE) - FRAME_HEADER_SIZE - FRAME_MAX_SIZE];	// Padding of the zero-copy frames
+	uint32_t crc;												// CRC sent in the frame header
+	uint16_t seq;												// Frame sequence number
+	uint16_t block;												// Frame size block of the application area the frame is written to
+	uint16_t length;											// Payload length in bytes
+	uint16_t count;												// Bytes received while filling, bytes programmed once ready
+	uint8_t flags;												// Frame flags, FRAME_FLAG_*
+	uint8_t state;												// e_Slot_State
+
+} s_Frame_Slot;
+
+// In zero-copy mode a slot is received as one block: the header then the payload right after it
+_Static_assert(offsetof(s_Frame_Slot, data) == FRAME_HEADER_SIZE, "the frame payload must follow its header");
+_Static_assert(RX_BLOCKS >= PIPELINE_SLOTS, "every slot must fit in the receive block queue");
+_Static_assert(sizeof(((s_Frame_Slot *)0)->padding) >= FRAME_FILL_SIZE, "the filler of a full frame is received in the padding");
+
+
+typedef struct
+{
+	uint16_t total_frames;										// Frames of the image
+	uint16_t frame_size;										// Negotiated frame size, only the last frame may be shorter
+	uint32_t app_checksum;										// Expected checksum of the whole image
+	uint8_t timeouts;											// Consecutive receive timeouts
+	uint8_t window;												// Frames the host may keep in flight
+	uint8_t filling;											// Slot receiving the next frame
+	uint8_t programming;										// Slot to program next, slots are programmed in the order they were filled
+	uint16_t base;												// First frame not committed yet
+	uint16_t chunk_first;										// First frame of the chunk held by the staging area
+	uint16_t chunk_frames;										// Frames the staging area holds
+	uint32_t accepted;											// Bit i is set if frame (base + i) is held in a slot or committed
+	uint32_t committed;											// Bit i is set if frame (base + i) is committed to flash
+	uint32_t staged_size;										// Bytes held by the staging area
+	uint32_t image_size;										// Size of the image, known once the last frame is committed
+	uint32_t last_activity;										// Tick of the last frame received or committed
+	uint32_t start;												// Cycle count when the download started
+	uint16_t blocks[WIN_MAX_SIZE];								// Block of each committed frame of the window, by sequence number modulo WIN_MAX_SIZE
+	uint16_t lengths[WIN_MAX_SIZE];								// Length of each committed frame of the window, by sequence number modulo WIN_MAX_SIZE
+	uint32_t kept_written[KEPT_BLOCKS_WORDS];					// Bit n is set once block n of the kept sector, from its first block, is written
+	uint8_t kept_sector;										// Sector copied to the staging area before its erase, FLASH_TOTAL_SECTORS if none
+	bool zero_copy;												// The frames are received in place into the slots
+	bool segmented;												// The frames carry their block, the gaps between them are not sent
+	bool keep_blocks;											// The blocks not sent keep their content, for a DOWNLOAD_SYNC command
+	bool tail_queued;											// The erases of the sectors past the image are queued
+
+} s_Download;
+
 
 /* Global variables --------------------------------------------------------------*/
 
-static uint8_t packet_buffer[128] = {0};						// Buffer to store received packets
+static uint8_t packet_buffer[128] __ALIGNED(4) = {0};			// Buffer to store received packets
+static s_Frame_Slot frame_slots[PIPELINE_SLOTS];				// Receive/program pipeline buffers
 static uint8_t error_id;										// Save the actual error id to be sent
+static uint16_t session_frame_size = FRAME_MIN_SIZE;			// Frame size negotiated with the host
+static uint8_t session_flags = 0;								// Session flags negotiated with the host
+static uint32_t staging_buffer[STAGING_SIZE / 4];				// Store-and-forward staging area
+static uint32_t inflate_buffer[FRAME_MAX_SIZE / 4];				// Output of the frame decompression, also its history window
+static bool app_modified = false;								// Set once the application area has been erased
+#ifdef BL_RAM_HOTPATH
+static uint32_t ram_vector_table[VECTOR_TABLE_SIZE] __ALIGNED(512);	// Vector table copied to RAM, VTOR needs it aligned on its size
+#endif
+static uint8_t erased_sectors = 0;								// Bit n is set once sector n has been erased by the current operation
+static uint8_t blank_sectors = 0;								// Bit n is set while sector n is known to be fully erased
+static uint8_t erase_tries[FLASH_TOTAL_SECTORS];				// Attempts left to erase each sector queued to the flash driver
+static volatile uint8_t erase_status = FLASH_OK;				// First error of the sectors erased by the flash driver
+static bool image_info_valid = false;							// Set while installed_size and installed_checksum match the application area
+static uint32_t installed_size = 0;								// Bytes of the installed image, up to its last word not blank
+static uint32_t installed_checksum = 0;							// Checksum of the installed image
+static uint32_t image_crc = CRC_INITIAL_VALUE;					// CRC of the image part downloaded in sequence
+static s_Download download;										// Windowed download, kept from one step to the next
+static e_Bootloader_State currentState = BL_STATE_IDLE;		// State of the command state machine
 
 
 /* Static Functions --------------------------------------------------------------*/
@@ -40,7 +175,7 @@ static void SendError(void)
 	error_msg[1] = error_id;
 	error_msg[2] = 0;				// padding to complete CMD_RESP_PACKET_SIZE
 
-	while(CDC_Transmit_FS(error_msg, CMD_RESP_PACKET_SIZE) == USBD_BUSY);
+	CDC_Transmit_FS(error_msg, CMD_RESP_PACKET_SIZE);
 }
 
 /**
@@ -56,7 +191,7 @@ static void SendCmdAck(uint8_t command_id)
 	cmd_ack_msg[1] = command_id;
 	cmd_ack_msg[2] = 0; 			// padding to complete CMD_RESP_PACKET_SIZE
 
-	while(CDC_Transmit_FS(cmd_ack_msg, CMD_RESP_PACKET_SIZE) == USBD_BUSY);
+	CDC_Transmit_FS(cmd_ack_msg, CMD_RESP_PACKET_SIZE);
 }
 
 /**
@@ -72,7 +207,7 @@ static void SendPacketAck(uint16_t packet_number)
 	packet_ack_msg[1] = (uint8_t)(packet_number);			// Set the lower byte of the packet number
 	packet_ack_msg[2] = (uint8_t)(packet_number >> 8);		// Set the upper byte of the packet number
 
-	while(CDC_Transmit_FS(packet_ack_msg, CMD_RESP_PACKET_SIZE) == USBD_BUSY);
+	CDC_Transmit_FS(packet_ack_msg, CMD_RESP_PACKET_SIZE);
 }
 
 /**
@@ -88,298 +223,2133 @@ static void SendPacketNAck(uint16_t packet_number)
 	packet_nack_msg[1] = (uint8_t)(packet_number);			// Set the lower byte of the packet number
 	packet_nack_msg[2] = (uint8_t)(packet_number >> 8);		// Set the upper byte of the packet number
 
-	while(CDC_Transmit_FS(packet_nack_msg, CMD_RESP_PACKET_SIZE) == USBD_BUSY);
+	CDC_Transmit_FS(packet_nack_msg, CMD_RESP_PACKET_SIZE);
 }
 
+/**
+ * @brief	Send the message refusing a patch whose source is overwritten, the host sends the frame again unpatched.
+ * @param	seq: The sequence number of the frame refused.
+ * @return	None
+ */
+static void SendDeltaNAck(uint16_t seq)
+{
+	uint8_t delta_nack_msg[CMD_RESP_PACKET_SIZE] = {0};
+
+	delta_nack_msg[0] = CMD_ID_DELTA_NACK;
+	delta_nack_msg[1] = (uint8_t)(seq);						// Set the lower byte of the sequence number
+	delta_nack_msg[2] = (uint8_t)(seq >> 8);				// Set the upper byte of the sequence number
 
-/* Functions --------------------------------------------------------------*/
+	CDC_Transmit_FS(delta_nack_msg, CMD_RESP_PACKET_SIZE);
+}
 
 /**
- * @brief	Run the Bootloader state machine
- * @param	None
+ * @brief	Send the window acknowledgment message.
+ * @param	base: The sequence number of the first packet not yet received (cumulative acknowledgment).
+ * @param	bitmap: Bit i is set if packet (base + 1 + i) has already been received.
  * @return	None
  */
-void Bootloader_Run(void)
+static void SendWindowAck(uint16_t base, uint32_t bitmap)
 {
-    uint8_t status;
-    uint16_t total_packets = 0;
-    uint32_t app_total_words = 0;
-    uint32_t app_checksum = 0;
+	uint8_t win_ack_msg[WIN_ACK_PACKET_SIZE] = {0};
 
-    e_Bootloader_State currentState = BL_STATE_IDLE;
+	win_ack_msg[0] = CMD_ID_WIN_ACK;
+	win_ack_msg[1] = (uint8_t)(base);						// Set the lower byte of the base
+	win_ack_msg[2] = (uint8_t)(base >> 8);					// Set the upper byte of the base
+	win_ack_msg[3] = (uint8_t)(bitmap);
+	win_ack_msg[4] = (uint8_t)(bitmap >> 8);
+	win_ack_msg[5] = (uint8_t)(bitmap >> 16);
+	win_ack_msg[6] = (uint8_t)(bitmap >> 24);
 
-    // Initialize the Flash Memory
-	status = Flash_Init();
+	CDC_Transmit_FS(win_ack_msg, WIN_ACK_PACKET_SIZE);
+}
 
-	if(status != FLASH_OK)
-	{
-		error_id = status;
-		currentState = BL_STATE_SEND_ERROR;
-	}
+/**
+ * @brief	Number of frames the host may keep in flight for a frame size.
+ *
+ * 			The frames in flight fit in the CDC receive ring, so the host is not held off by the flow control.
+ * @param	frame_size: The negotiated frame size in bytes.
+ * @return	The window size in frames.
+ */
+static uint8_t GetWindowSize(uint16_t frame_size)
+{
+	uint32_t window = (RX_BUFFER_SIZE - 1) / (FRAME_HEADER_SIZE + frame_size);
 
-    while(1)
-    {
+	return (uint8_t)((window > WIN_MAX_SIZE) ? WIN_MAX_SIZE : window);
+}
 
-    	switch (currentState)
-    	{
-    		case BL_STATE_IDLE:
+/**
+ * @brief	Read a frame header into a slot.
+ * @param	slot: The slot receiving the frame.
+ * @param	header: The FRAME_HEADER_SIZE bytes of the header.
+ * @param	frame_size: The negotiated frame size.
+ * @return	false if this is not a valid frame header, the frame stream is out of synchronization.
+ */
+static bool ReadFrameHeader(s_Frame_Slot *slot, const uint8_t *header, uint16_t frame_size)
+{
+	slot->flags = header[1];
+	slot->seq = ((uint16_t)header[2] & 0xFF) | (((uint16_t)header[3] << 8) & 0xFF00);
+	slot->length = ((uint16_t)header[4] & 0xFF) | (((uint16_t)header[5] << 8) & 0xFF00);
+	slot->block = download.segmented ? (((uint16_t)header[6] & 0xFF) | (((uint16_t)header[7] << 8) & 0xFF00)) : slot->seq;
+	slot->crc = ((uint32_t)header[8] & 0xFF) | (((uint32_t)header[9] << 8) & 0xFF00) |
+			(((uint32_t)header[10] << 16) & 0xFF0000) | (((uint32_t)header[11] << 24) & 0xFF000000);
+
+	return (header[0] == CMD_ID_PACKET) && (slot->length != 0) && (slot->length <= frame_size) && ((slot->length % 4) == 0);
+}
 
-    			CDC_FlushRxBuffer_FS();
+/**
+ * @brief	Number of bytes following the header of a frame in the stream: its payload, then the filler of a FRAME_FLAG_FILL frame.
+ * @param	slot: The slot holding the header of the frame.
+ * @return	The number of bytes.
+ */
+static uint16_t FrameReceiveSize(const s_Frame_Slot *slot)
+{
+	return slot->length + ((slot->flags & FRAME_FLAG_FILL) ? FRAME_FILL_SIZE : 0);
+}
 
-    			status = CDC_ReadRxBuffer_FS(packet_buffer, CMD_PACKET_SIZE, MAX_TIMEOUT);
+/**
+ * @brief	Replace the payload of a frame by the data decoded from it into inflate_buffer.
+ * @param	slot: The slot holding the frame.
+ * @param	length: The number of bytes decoded.
+ * @return	false if the decoded data is not a whole number of words.
+ */
+static bool StoreFrameOutput(s_Frame_Slot *slot, uint32_t length)
+{
+	if((length == 0) || ((length % 4) != 0))
+	{
+		return false;
+	}
 
-    			if(status == USBD_OK)
-    			{
-    				switch (packet_buffer[0])
-    				{
-    					case CMD_ID_EXECUTE:
-    						currentState = BL_STATE_EXECUTE;
-    						break;
-
-    					case CMD_ID_DOWNLOAD_FW:
-    		    			total_packets = ((uint16_t)packet_buffer[1] & 0xFF) | (((uint16_t)packet_buffer[2] << 8) & 0xFF00);
-
-    		    			app_checksum = ((uint32_t)packet_buffer[3] & 0xFF) | (((uint32_t)packet_buffer[4] << 8) & 0xFF00) |
-    		    					(((uint32_t)packet_buffer[5] << 16) & 0xFF0000) | (((uint32_t)packet_buffer[6] << 24) & 0xFF000000);
-
-    						currentState = BL_STATE_DOWNLOAD_FW;
-    						break;
-
-    					case CMD_ID_ERASE_APP:
-    						currentState = BL_STATE_ERASE_APP;
-    						break;
-
-    					default:
-    						error_id = BL_CMD_INVALID;
-    						currentState = BL_STATE_SEND_ERROR;
-    						break;
-    				}
-    			}
+	memcpy(slot->data, inflate_buffer, length);
+	slot->length = (uint16_t)length;
 
-    			break;
+	return true;
+}
 
-    		// This state comes after failing to download the new firmware
-    		case BL_STATE_ABORT:
+/**
+ * @brief	Decompress the LZSS payload of a frame in place of it.
+ *
+ * 			Each frame is compressed on its own, so the history window is the frame itself and the
+ * 			decompression needs no RAM besides the output buffer. The payload is a sequence of groups:
+ * 			a flag byte then eight items, a literal byte for a flag bit set, otherwise a match of two
+ * 			bytes: the distance minus 1 on 12 bits (low byte first, then the upper nibble of the second
+ * 			byte), and the length minus LZSS_MIN_MATCH on the lower nibble.
+ * @param	slot: The slot holding the frame, its payload and length are replaced by the decompressed data.
+ * @param	frame_size: The negotiated frame size, the largest output accepted.
+ * @return	false if the payload is not a valid stream of a whole number of words.
+ */
+static bool InflateFrame(s_Frame_Slot *slot, uint16_t frame_size)
+{
+	const uint8_t *in = (const uint8_t *)slot->data;
+	const uint8_t *in_end = in + slot->length - (slot->flags & FRAME_FLAG_PAD_MASK);
+	uint8_t *out = (uint8_t *)inflate_buffer;
+	uint8_t *out_end = out + frame_size;
+	uint8_t flags = 0;
+	uint8_t items = 0;
+	uint32_t distance;
+	uint32_t length;
+	uint32_t cycles = Perf_GetCycles();
+
+	while(in < in_end)
+	{
+		if(items == 0)
+		{
+			flags = *in++;
+			items = 8;
+			continue;
+		}
 
-    			Bootloader_EraseApplication();
-    			SendError();
-    			currentState = BL_STATE_IDLE;
+		if(flags & 1)
+		{
+			if(out == out_end)
+			{
+				return false;
+			}
 
-    			break;
+			*out++ = *in++;
+		}
+		else
+		{
+			if((in_end - in) < 2)
+			{
+				return false;
+			}
 
+			distance = ((uint32_t)in[0] | (((uint32_t)in[1] & 0xF0) << 4)) + 1;
+			length = ((uint32_t)in[1] & 0x0F) + LZSS_MIN_MATCH;
+			in += 2;
 
-    		case BL_STATE_EXECUTE:
+			if((distance > (uint32_t)(out - (uint8_t *)inflate_buffer)) || (length > (uint32_t)(out_end - out)))
+			{
+				return false;
+			}
 
-    			if(Bootloader_CheckApplicationExist() == true)
-    			{
-					SendCmdAck(CMD_ID_EXECUTE);
-    				Bootloader_JumToApplication();
-    			}
-    			else
-    			{
-    				error_id = BL_NO_USER_APP;
-    				currentState = BL_STATE_SEND_ERROR;
-    			}
+			// The match may overlap the bytes it produces
+			while(length--)
+			{
+				*out = *(out - distance);
+				out++;
+			}
+		}
 
-    			break;
+		flags >>= 1;
+		items--;
+	}
 
+	if(StoreFrameOutput(slot, out - (uint8_t *)inflate_buffer) == false)
+	{
+		return false;
+	}
 
-    		case BL_STATE_SEND_ERROR:
+	perf_counters[PERF_INFLATED_BYTES] += slot->length;
+	Perf_AddCycles(PERF_INFLATE_CYCLES, cycles);
 
-    			SendError();
-    			currentState = BL_STATE_IDLE;
+	return true;
+}
 
-    			break;
+/**
+ * @brief	Rebuild a frame from a patch against the installed application, in place of the patch.
+ *
+ * 			The patch is a sequence of operations: DELTA_OP_COPY copies bytes of the installed
+ * 			application from its offset in the application area, DELTA_OP_INSERT inserts the bytes
+ * 			following it. The application is overwritten as the download goes: a copy from a sector
+ * 			already erased and programmed by the download fails, the host only copies from the sectors
+ * 			no earlier frame is written to, so this only happens to a frame resent too late.
+ * @param	slot: The slot holding the frame, its payload and length are replaced by the rebuilt data.
+ * @param	frame_size: The negotiated frame size, the largest output accepted.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_DELTA_SOURCE_LOST: The patch copies data the download has already overwritten.
+ * 			- BL_DOWNLOAD_FAILED: The patch is not valid.
+ *			- BL_OK: The frame is rebuilt.
+ */
+static uint8_t PatchFrame(s_Frame_Slot *slot, uint16_t frame_size)
+{
+	const uint8_t *in = (const uint8_t *)slot->data;
+	const uint8_t *in_end = in + slot->length - (slot->flags & FRAME_FLAG_PAD_MASK);
+	uint8_t *out = (uint8_t *)inflate_buffer;
+	uint8_t *out_end = out + frame_size;
+	uint8_t overwritten = erased_sectors & ~blank_sectors;		// Sectors erased then programmed by the download
+	uint8_t op;
+	uint32_t length;
+	uint32_t source;
+
+	while(in < in_end)
+	{
+		if((in_end - in) < 3)
+		{
+			return BL_DOWNLOAD_FAILED;
+		}
 
+		op = in[0];
+		length = (uint32_t)in[1] | ((uint32_t)in[2] << 8);
+		in += 3;
 
-    		case BL_STATE_DOWNLOAD_FW:
+		if(length > (uint32_t)(out_end - out))
+		{
+			return BL_DOWNLOAD_FAILED;
+		}
 
-    			SendCmdAck(CMD_ID_DOWNLOAD_FW);
+		if((op == DELTA_OP_COPY) && ((in_end - in) >= 4))
+		{
+			memcpy(&source, in, sizeof(source));
+			in += 4;
 
-    			status = Bootloader_DownloadFW(total_packets);
+			if((length == 0) || (source > (APP_END_ADDRESS - APP_BASE_ADDRESS - length)))
+			{
+				return BL_DOWNLOAD_FAILED;
+			}
 
-    			if(status == BL_OK)
-    			{
-        			app_total_words = (total_packets * 64) / 4;								// Calculate total words in the application
-    				status = Bootloader_VerifyAppChecksum(app_checksum, app_total_words);	// Verify application checksum
-    			}
+			for(uint8_t sector = Flash_GetSector(APP_BASE_ADDRESS + source); sector <= Flash_GetSector(APP_BASE_ADDRESS + source + length - 1); sector++)
+			{
+				if(overwritten & (1U << sector))
+				{
+					return BL_DELTA_SOURCE_LOST;
+				}
+			}
 
-    			if(status == BL_OK)
-    			{
-        			currentState = BL_STATE_EXECUTE;
-    			}
-    			else
-    			{
-    				error_id = status;
-    				currentState = BL_STATE_ABORT;
-    			}
+			memcpy(out, (const void *)(APP_BASE_ADDRESS + source), length);
+			perf_counters[PERF_DELTA_COPY_BYTES] += length;
+		}
+		else if((op == DELTA_OP_INSERT) && ((uint32_t)(in_end - in) >= length))
+		{
+			memcpy(out, in, length);
+			in += length;
+		}
+		else
+		{
+			return BL_DOWNLOAD_FAILED;
+		}
 
-    			break;
+		out += length;
+	}
 
+	return StoreFrameOutput(slot, out - (uint8_t *)inflate_buffer) ? BL_OK : BL_DOWNLOAD_FAILED;
+}
 
-    		case BL_STATE_ERASE_APP:
+/**
+ * @brief	Send the session information message, with the size of the staging area the host splits staged downloads by.
+ * @param	frame_size: The frame size accepted by the bootloader.
+ * @param	flags: The session flags accepted by the bootloader.
+ * @return	None
+ */
+static void SendSessionInfo(uint16_t frame_size, uint8_t flags)
+{
+	uint8_t session_info_msg[SESSION_INFO_PACKET_SIZE] = {0};
 
-    			status = Bootloader_EraseApplication();
+	session_info_msg[0] = CMD_ID_SESSION_INFO;
+	session_info_msg[1] = (uint8_t)(frame_size);			// Set the lower byte of the frame size
+	session_info_msg[2] = (uint8_t)(frame_size >> 8);		// Set the upper byte of the frame size
+	session_info_msg[3] = GetWindowSize(frame_size);
+	session_info_msg[4] = flags;
+	session_info_msg[5] = (uint8_t)(STAGING_SIZE / 1024);			// Set the lower byte of the staging size
+	session_info_msg[6] = (uint8_t)((STAGING_SIZE / 1024) >> 8);	// Set the upper byte of the staging size
 
-    			if(status != BL_OK)
-    			{
-    				error_id = status;
-    				currentState = BL_STATE_SEND_ERROR;
-    			}
-    			else
-    			{
-					SendCmdAck(CMD_ID_ERASE_APP);
-					currentState = BL_STATE_IDLE;
-    			}
+	CDC_Transmit_FS(session_info_msg, SESSION_INFO_PACKET_SIZE);
+}
 
-    			break;
+/**
+ * @brief	Send the result of a CHECKSUM command.
+ * @param	checksum: The checksum of the requested area.
+ * @return	None
+ */
+static void SendChecksum(uint32_t checksum)
+{
+	uint8_t checksum_msg[CHECKSUM_PACKET_SIZE] = {0};
 
+	checksum_msg[0] = CMD_ID_CHECKSUM_INFO;
+	memcpy(&checksum_msg[1], &checksum, sizeof(checksum));		// Little endian, as the rest of the protocol
 
-    		default:
+	CDC_Transmit_FS(checksum_msg, CHECKSUM_PACKET_SIZE);
+}
 
-    			error_id = BL_INVALID_STATE;
-    			currentState = BL_STATE_SEND_ERROR;
+/**
+ * @brief	Send the header of the result of a BLOCK_HASH command, the checksums follow it.
+ * @param	count: The number of block checksums following.
+ * @return	None
+ */
+static void SendBlockHashInfo(uint16_t count)
+{
+	uint8_t hash_msg[CMD_RESP_PACKET_SIZE];
 
-    			break;
-    	}
-    }
+	hash_msg[0] = CMD_ID_BLOCK_HASH_INFO;
+	hash_msg[1] = (uint8_t)(count);			// Set the lower byte of the count
+	hash_msg[2] = (uint8_t)(count >> 8);	// Set the upper byte of the count
 
+	CDC_Transmit_FS(hash_msg, CMD_RESP_PACKET_SIZE);
 }
 
 /**
- * @brief	Jumps to the user application
- * @param	None
- * @return	None
+ * @brief	Computes the checksums of the next blocks of the application area and queues them, as many
+ * 			as the transmit queue has room for, up to BLOCK_HASH_BATCH.
+ * @param	block: The first block to hash.
+ * @param	count: The number of blocks of the area.
+ * @param	size: The size of the area in bytes, the last block may be shorter than the frame size.
+ * @return	The next block to hash.
  */
-void Bootloader_JumToApplication(void)
+static uint16_t SendBlockHashes(uint16_t block, uint16_t count, uint32_t size)
 {
-    uint32_t application_entry_point_address = *(volatile uint32_t *)(APP_BASE_ADDRESS + 4);
+	uint32_t hashes[BLOCK_HASH_BATCH];
+	uint32_t offset;
+	uint32_t length;
+	uint16_t batch = CDC_GetTxBufferFree_FS() / sizeof(uint32_t);
+	uint16_t n;
 
-    pFunction application_entry_point = (pFunction)application_entry_point_address ;
+	batch = (batch > BLOCK_HASH_BATCH) ? BLOCK_HASH_BATCH : batch;
 
-    // Reset peripherals
-    HAL_RCC_DeInit();
-    HAL_DeInit();
+	for(n = 0; (n < batch) && ((block + n) < count); n++)
+	{
+		offset = (uint32_t)(block + n) * session_frame_size;
+		length = size - offset;
+		length = (length > session_frame_size) ? session_frame_size : length;
 
-    // Reset Systick
-    SysTick->CTRL = 0;  // Disable SysTick
-    SysTick->VAL = 0;   // Reset current value
-    SysTick->LOAD = 0;  // Reset reload value
+		hashes[n] = Flash_GetChecksum(APP_BASE_ADDRESS + offset, length / 4);
+	}
 
-    // Set the vector table base address
-    SCB->VTOR = APP_BASE_ADDRESS;
+	if(n > 0)
+	{
+		CDC_Transmit_FS((uint8_t *)hashes, n * sizeof(uint32_t));		// Little endian, as the rest of the protocol
+	}
 
-    // Set the stack pointer
-    __set_MSP(*(volatile uint32_t*)(APP_BASE_ADDRESS));
+	return block + n;
+}
 
-    // Jump to the application
-    application_entry_point();
+/**
+ * @brief	Send the information of the installed image.
+ * @param	size: The size of the image in bytes.
+ * @param	checksum: The checksum of the image.
+ * @return	None
+ */
+static void SendImageInfo(uint32_t size, uint32_t checksum)
+{
+	uint8_t image_info_msg[IMAGE_INFO_PACKET_SIZE];
+
+	image_info_msg[0] = CMD_ID_IMAGE_INFO;
+	memcpy(&image_info_msg[1], &size, sizeof(size));				// Little endian, as the rest of the protocol
+	memcpy(&image_info_msg[5], &checksum, sizeof(checksum));
+
+	CDC_Transmit_FS(image_info_msg, IMAGE_INFO_PACKET_SIZE);
 }
 
 /**
- * @brief	Checks if a user application exists in the flash memory.
+ * @brief	Send the performance counters of the last operation.
  * @param	None
- * @return	True if a user application exists, false otherwise.
+ * @return	None
  */
-bool Bootloader_CheckApplicationExist(void)
+static void SendStats(void)
 {
-    uint32_t stack_address = 0;
+	uint8_t stats_msg[CMD_RESP_PACKET_SIZE + (PERF_COUNT * 4)];
 
-    Flash_Read_Word(APP_BASE_ADDRESS, &stack_address, (uint32_t)1);
+	stats_msg[0] = CMD_ID_STATS;
+	stats_msg[1] = PERF_COUNT;
+	stats_msg[2] = 0;				// padding to complete CMD_RESP_PACKET_SIZE
 
-    if ((stack_address < RAM_BASE_ADDRESS) || ((stack_address - RAM_BASE_ADDRESS) > RAM_SIZE))
-    {
-        return false;
-    }
+	memcpy(&stats_msg[CMD_RESP_PACKET_SIZE], perf_counters, sizeof(perf_counters));		// Little endian, as the rest of the protocol
 
-    return true;
+	CDC_Transmit_FS(stats_msg, sizeof(stats_msg));
 }
 
 /**
- * @brief	This function erases the application area in flash memory.
- * @param	None
+ * @brief	Program words into the application area with the engine selected for the session.
+ * @param	address: The flash address to program.
+ * @param	data: The words to program.
+ * @param	size: The number of words.
  * @return	Flash error code: e_Flash_Status
- *			- FLASH_ERASE_ERROR: The erase operation failed.
- *			- FLASH_OK: The erase operation was successful.
  */
-uint8_t Bootloader_EraseApplication(void)
+static uint8_t ProgramFlash(uint32_t address, uint32_t *data, uint32_t size)
 {
-	uint8_t status;
-	uint8_t try = 3;
+	perf_counters[PERF_PROGRAMMED_WORDS] += size;
 
-	for(uint8_t sector_num = APP_START_SECTOR; sector_num < FLASH_TOTAL_SECTORS; sector_num++)
+	if(session_flags & SESSION_FLAG_HAL_PROGRAM)
 	{
-		do
-		{
-			status = Flash_EraseSector(sector_num);
-
-		} while((status != FLASH_OK) && --try);
-
-		if(status != FLASH_OK)
-		{
-	    	break;
-		}
-
-		try = 3;
+		return Flash_Write_Word(address, data, size);
 	}
 
-    return status;
+	return Flash_Program_Burst(address, data, size);
 }
 
 /**
- * @brief	Downloads the firmware packets and writes them to the flash memory.
- * @param	The total number of firmware packets to download.
- * @return	Bootloader status code: e_Bootloader_Status
- * 			- BL_DOWNLOAD_FAILED: Failed to download the new firmware.
- *			- BL_OK: The download operation was successful.
+ * @brief	Verify a programmed block with the verify policy selected for the session.
+ * @param	address: The flash address of the block.
+ * @param	data: The words the block was programmed with.
+ * @param	size: The number of words.
+ * @param	crc: The expected CRC of the block, NULL to compute it from data.
+ * @return	Flash error code: e_Flash_Status
+ * 			- FLASH_WRITE_CORR_ERROR: The block in flash doesn't match.
+ *			- FLASH_OK: The block is correct or the policy doesn't verify.
  */
-uint8_t Bootloader_DownloadFW(uint16_t total_packets)
+static uint8_t VerifyFlash(uint32_t address, uint32_t *data, uint32_t size, const uint32_t *crc)
 {
-	uint8_t status;
-	uint8_t try_nb = 3;
-	uint16_t packet_num = 0;
-	uint16_t packet_size = 64;
-	uint16_t packet_total_words = packet_size / 4; // 64/4
-	uint32_t rcv_timeout = 2000;
-	uint32_t address = APP_BASE_ADDRESS;
-
-	status = Bootloader_EraseApplication();
+	uint8_t status = FLASH_OK;
+	uint32_t cycles = Perf_GetCycles();
 
-	if(status == BL_OK)
+	switch(session_flags & SESSION_VERIFY_MASK)
 	{
-		do
-		{
-			status = CDC_ReadRxBuffer_FS(packet_buffer, 64, rcv_timeout);
-
-			if(status == USBD_OK)
-			{
-				SendPacketAck(packet_num);
-				status = Flash_Write_Word(address, (uint32_t *)packet_buffer, packet_total_words);
-				address = address + packet_size;
-				packet_num ++;
-				try_nb = 3;
+		case SESSION_VERIFY_NONE:
+			break;
 
-				//while(CDC_Transmit_FS(packet_buffer, 64) == USBD_BUSY);
-			}
-			else if(try_nb > 0)
+		case SESSION_VERIFY_READBACK:
+			if(memcmp((const void *)address, data, size * 4) != 0)
 			{
-				SendPacketNAck(packet_num);
-				try_nb --;
+				status = FLASH_WRITE_CORR_ERROR;
 			}
-			else
+			break;
+
+		default:
+			if(Flash_GetChecksum(address, size) != ((crc != NULL) ? *crc : Flash_GetChecksum((uint32_t)data, size)))
 			{
-				break;
+				status = FLASH_WRITE_CORR_ERROR;
 			}
+			break;
+	}
 
-		} while(packet_num < total_packets);
+	Perf_AddCycles(PERF_VERIFY_CYCLES, cycles);
 
-		if(packet_num != total_packets)
-		{
-			status = BL_DOWNLOAD_FAILED;
-		}
+	return status;
+}
+
+/**
+ * @brief	Flash address of a frame size block of the application area.
+ * @param	block: The block number.
+ * @return	The address of the block.
+ */
+static uint32_t BlockAddress(uint16_t block)
+{
+	return APP_BASE_ADDRESS + ((uint32_t)block * download.frame_size);
+}
+
+/**
+ * @brief	Tell whether the final checksum re-reads the whole image instead of using the running CRC.
+ * @param	None
+ * @return	True if the image is re-read.
+ */
+static bool RereadImage(void)
+{
+	// The checksum of a segmented image covers its segments only, not the gaps between them
+	return ((IMAGE_CHECKSUM_REREAD != 0) || ((session_flags & SESSION_FLAG_REREAD) != 0)) && (download.segmented == false);
+}
+
+/**
+ * @brief	Check the downloaded image against its expected checksum. The CRC accumulated while
+ * 			the image was programmed is used, unless a full re-read of the image is requested.
+ * @param	app_checksum: The expected checksum of the image.
+ * @param	app_word_size: The size of the image in words.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_CHKS_MISMATCH: The image doesn't match the expected checksum
+ *			- BL_OK: The image matches the expected checksum
+ */
+static uint8_t CheckImage(uint32_t app_checksum, uint32_t app_word_size)
+{
+	if(RereadImage() == false)
+	{
+		return (image_crc == app_checksum) ? BL_OK : BL_CHKS_MISMATCH;
 	}
 
-    return status;
+	return Bootloader_VerifyAppChecksum(app_checksum, app_word_size);
+}
+
+/**
+ * @brief	Tell whether a sector is blank, from what is known about it or from a blank check.
+ * @param	sector: The sector number.
+ * @return	True if the sector is fully erased.
+ */
+static bool IsSectorBlank(uint8_t sector)
+{
+	uint32_t cycles;
+	bool blank = ((blank_sectors & (1U << sector)) != 0);
+
+	if(blank == false)
+	{
+		cycles = Perf_GetCycles();
+		blank = Flash_IsSectorBlank(sector);
+		Perf_AddCycles(PERF_BLANK_CHECK_CYCLES, cycles);
+	}
+
+	return blank;
+}
+
+/**
+ * @brief	Finds the end of the installed image: the blank sectors, then the blank pages and words
+ * 			are skipped from the end of the application area.
+ * @param	None
+ * @return	The size of the image in bytes, up to its last word not blank.
+ */
+static uint32_t FindImageEnd(void)
+{
+	uint32_t end = APP_END_ADDRESS;
+
+	for(uint8_t sector = FLASH_TOTAL_SECTORS - 1; (sector >= APP_START_SECTOR) && IsSectorBlank(sector); sector--)
+	{
+		end = Flash_GetSectorAddress(sector);
+	}
+
+	while((end > APP_BASE_ADDRESS) && Flash_IsBlank(end - FLASH_PAGE_SIZE, FLASH_PAGE_SIZE / 4))
+	{
+		end -= FLASH_PAGE_SIZE;
+	}
+
+	while((end > APP_BASE_ADDRESS) && (*(volatile uint32_t *)(end - 4) == 0xFFFFFFFF))
+	{
+		end -= 4;
+	}
+
+	return end - APP_BASE_ADDRESS;
+}
+
+/**
+ * @brief	Completion of a sector erase queued by Bootloader_StartEraseApplication or StartEraseImageTail,
+ * 			called from the flash interrupt. A failed erase is queued again until the sector runs out of attempts.
+ * @param	status: The flash status of the erase.
+ * @param	sector: The sector erased.
+ * @return	None
+ */
+static void EraseSectorDone(uint8_t status, uint32_t sector)
+{
+	if(status == FLASH_OK)
+	{
+		erased_sectors |= (1U << sector);
+		blank_sectors |= (1U << sector);
+		perf_counters[PERF_ERASED_SECTORS] |= (1U << sector);
+	}
+	else if((--erase_tries[sector] == 0) || (Flash_QueueErase((uint8_t)sector, EraseSectorDone) != FLASH_OK))
+	{
+		erase_status = status;
+	}
+}
+
+/**
+ * @brief	Starts erasing the sectors past the end of a downloaded image that still hold data, so a shorter
+ * 			image doesn't leave the end of the previous one behind: FindImageEnd would report its length.
+ * 			As Bootloader_StartEraseApplication, the sectors failing their blank check are queued to the
+ * 			flash driver: the erase is over once Flash_IsBusy returns false, erase_status then holds its result.
+ * @param	image_size: The size of the downloaded image in bytes.
+ * @return	None
+ */
+static void StartEraseImageTail(uint32_t image_size)
+{
+	uint8_t status = FLASH_OK;
+	uint8_t sector = (image_size == 0) ? APP_START_SECTOR : (Flash_GetSector(APP_BASE_ADDRESS + image_size - 1) + 1);
+
+	erase_status = FLASH_OK;
+
+	for(; (sector < FLASH_TOTAL_SECTORS) && (status == FLASH_OK); sector++)
+	{
+		if((erased_sectors & (1U << sector)) != 0)
+		{
+			continue;
+		}
+
+		if(IsSectorBlank(sector) == true)
+		{
+			perf_counters[PERF_ERASES_SKIPPED]++;
+			erased_sectors |= (1U << sector);
+			blank_sectors |= (1U << sector);
+		}
+		else
+		{
+			app_modified = true;
+			image_info_valid = false;
+			erase_tries[sector] = ERASE_TRIES;
+			status = Flash_QueueErase(sector, EraseSectorDone);
+		}
+	}
+
+	if(status != FLASH_OK)
+	{
+		erase_status = status;
+	}
+}
+
+/**
+ * @brief	Copies the sector holding an address to the staging area before a sync download erases it,
+ * 			so the blocks the download doesn't send are programmed back once it ends. Only one sector
+ * 			fitting in the staging area is kept, the host sends every block of the other ones.
+ * @param	address: The flash address about to be programmed.
+ * @return	None
+ */
+static void KeepSector(uint32_t address)
+{
+	uint8_t sector = Flash_GetSector(address);
+	uint32_t sector_address = Flash_GetSectorAddress(sector);
+	uint32_t sector_size = Flash_GetSectorAddress(sector + 1) - sector_address;
+
+	// Once erased by the download, the sector holds only what the download wrote
+	if(((erased_sectors & (1U << sector)) != 0) || (download.kept_sector != FLASH_TOTAL_SECTORS) || (sector_size > STAGING_SIZE))
+	{
+		return;
+	}
+
+	memcpy(staging_buffer, (const void *)sector_address, sector_size);
+	download.kept_sector = sector;
+}
+
+/**
+ * @brief	Records a frame written by a sync download, so its block of the kept sector isn't programmed back.
+ * @param	block: The frame size block of the application area written.
+ * @return	None
+ */
+static void MarkBlockWritten(uint16_t block)
+{
+	uint16_t first_block;
+
+	if(download.kept_sector == FLASH_TOTAL_SECTORS)
+	{
+		return;
+	}
+
+	first_block = (uint16_t)((Flash_GetSectorAddress(download.kept_sector) - APP_BASE_ADDRESS) / download.frame_size);
+
+	if((block >= first_block) && ((block - first_block) < (KEPT_BLOCKS_WORDS * 32)))
+	{
+		download.kept_written[(block - first_block) / 32] |= (1UL << ((block - first_block) % 32));
+	}
+}
+
+/**
+ * @brief	Programs back the blocks of the kept sector the sync download didn't write, from the staging area.
+ * 			The blank blocks are left erased.
+ * @param	None
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_DOWNLOAD_FAILED: Programming the flash failed.
+ * 			- BL_VERIFY_FAILED: A block programmed back doesn't match its copy.
+ *			- BL_OK: The kept sector holds its blocks again.
+ */
+static uint8_t RestoreKeptBlocks(void)
+{
+	uint32_t sector_address;
+	uint32_t sector_end;
+	uint16_t first_block;
+	uint32_t start;
+	uint32_t end;
+	uint32_t *data;
+
+	if(download.kept_sector == FLASH_TOTAL_SECTORS)
+	{
+		return BL_OK;
+	}
+
+	sector_address = Flash_GetSectorAddress(download.kept_sector);
+	sector_end = Flash_GetSectorAddress(download.kept_sector + 1);
+	first_block = (uint16_t)((sector_address - APP_BASE_ADDRESS) / download.frame_size);
+
+	for(uint16_t block = first_block; BlockAddress(block) < sector_end; block++)
+	{
+		// A block across a sector boundary is restored for its part in the kept sector only
+		start = (BlockAddress(block) < sector_address) ? sector_address : BlockAddress(block);
+		end = BlockAddress(block + 1);
+		end = (end > sector_end) ? sector_end : end;
+		data = &staging_buffer[(start - sector_address) / 4];
+
+		if(((download.kept_written[(block - first_block) / 32] & (1UL << ((block - first_block) % 32))) != 0) ||
+			Flash_IsBlank((uint32_t)data, (end - start) / 4))
+		{
+			continue;
+		}
+
+		if(ProgramFlash(start, data, (end - start) / 4) != FLASH_OK)
+		{
+			return BL_DOWNLOAD_FAILED;
+		}
+
+		if(VerifyFlash(start, data, (end - start) / 4, NULL) != FLASH_OK)
+		{
+			return BL_VERIFY_FAILED;
+		}
+
+		perf_counters[PERF_KEPT_BYTES] += end - start;
+	}
+
+	return BL_OK;
+}
+
+/**
+ * @brief	Ends a windowed download: releases the receive path and the flash.
+ * @param	status: The status the download ends with.
+ * @return	The status the download ends with.
+ */
+static uint8_t EndDownloadWindowed(uint8_t status)
+{
+	if(download.zero_copy)
+	{
+		CDC_StopRxBlocks_FS();
+	}
+
+	// The other commands may be followed by data that doesn't end with a short packet
+	CDC_SetRxTransferSize_FS(CDC_DATA_FS_OUT_PACKET_SIZE);
+
+	Flash_Close();
+
+	Perf_AddCycles(PERF_DOWNLOAD_CYCLES, download.start);
+
+    return status;
+}
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	Run the Bootloader: its state machine becomes a task of the scheduler, which never returns.
+ * @param	None
+ * @return	None
+ */
+void Bootloader_Run(void)
+{
+    uint8_t status;
+
+#ifdef BL_RAM_HOTPATH
+    // The USB and tick handlers run from RAM, see STM32F411CEUX_FLASH_RAM_HOTPATH.ld: their vectors must not be fetched from flash either
+    memcpy(ram_vector_table, (const void *)SCB->VTOR, sizeof(ram_vector_table));
+
+    __disable_irq();
+    SCB->VTOR = (uint32_t)ram_vector_table;
+    __DSB();
+    __enable_irq();
+#endif
+
+    Perf_Init();
+
+    // Initialize the Flash Memory
+	status = Flash_Init();
+
+	if(status != FLASH_OK)
+	{
+		error_id = status;
+		currentState = BL_STATE_SEND_ERROR;
+	}
+
+	Sched_Init();
+	Sched_AddTask(Bootloader_Task, SCHED_EVENT_RX | SCHED_EVENT_TX | SCHED_EVENT_DMA | SCHED_EVENT_TICK | SCHED_EVENT_FLASH);
+	Sched_Run();
+}
+
+/**
+ * @brief	Run one step of the Bootloader state machine, without waiting: the states waiting for
+ * 			the host or for the DMA return at once and are stepped again on their next event.
+ * @param	None
+ * @return	True if the state machine has more work ready, false if it waits for an event.
+ */
+bool Bootloader_Task(void)
+{
+    uint8_t status;
+    static uint16_t total_packets = 0;
+    static uint16_t frame_size = 0;
+    static uint8_t flags = 0;
+    uint32_t app_total_words = 0;
+    static uint32_t app_size = 0;
+    static uint32_t app_checksum = 0;
+    static uint32_t tail_start;
+    static uint32_t checksum_size = 0;
+    static uint32_t checksum_start = 0;
+    uint32_t checksum;
+    uint16_t previous_block;
+    static uint8_t checksum_engine = CHECKSUM_ENGINE_CPU;
+    static uint16_t hash_block = 0;
+    static uint16_t hash_count = 0;
+    static uint32_t upload_address = 0;
+    static uint32_t upload_size = 0;
+    static uint32_t upload_activity = 0;
+    uint16_t length;
+    uint8_t *tx_buffer;
+    const uint8_t *rx_data;
+    static uint8_t download_cmd = CMD_ID_DOWNLOAD_WIN;
+    static e_Bootloader_State previousState = BL_STATE_IDLE;
+
+    e_Bootloader_State state = currentState;
+    bool ready = false;
+
+    switch (currentState)
+    {
+    	case BL_STATE_IDLE:
+
+    		// What the host sent during the previous command is dropped once, when the state is entered.
+    		// The commands sent during an erase were left for this state, see BL_STATE_ERASE_WAIT
+    		if((previousState != BL_STATE_IDLE) && (previousState != BL_STATE_ERASE_WAIT))
+    		{
+    			CDC_FlushRxBuffer_FS();
+    		}
+
+    		// Wait for a whole command, the state is stepped again when more data arrives
+    		if(CDC_GetRxBufferBytesAvailable_FS() < CMD_PACKET_SIZE)
+    		{
+    			break;
+    		}
+
+    		status = CDC_ReadRxBuffer_FS(packet_buffer, CMD_PACKET_SIZE, NO_TIMEOUT);
+
+    		if(status == USBD_OK)
+    		{
+    			switch (packet_buffer[0])
+    			{
+    				case CMD_ID_EXECUTE:
+    					currentState = BL_STATE_EXECUTE;
+    					break;
+
+    				case CMD_ID_DOWNLOAD_FW:
+    				case CMD_ID_DOWNLOAD_WIN:
+    				case CMD_ID_DOWNLOAD_SEG:
+    				case CMD_ID_DOWNLOAD_SYNC:
+    	    			total_packets = ((uint16_t)packet_buffer[1] & 0xFF) | (((uint16_t)packet_buffer[2] << 8) & 0xFF00);
+
+    	    			app_checksum = ((uint32_t)packet_buffer[3] & 0xFF) | (((uint32_t)packet_buffer[4] << 8) & 0xFF00) |
+    	    					(((uint32_t)packet_buffer[5] << 16) & 0xFF0000) | (((uint32_t)packet_buffer[6] << 24) & 0xFF000000);
+
+    	    			download_cmd = packet_buffer[0];
+    					currentState = (packet_buffer[0] == CMD_ID_DOWNLOAD_FW) ? BL_STATE_DOWNLOAD_FW : BL_STATE_DOWNLOAD_WIN;
+    					break;
+
+    				case CMD_ID_ERASE_APP:
+    					currentState = BL_STATE_ERASE_APP;
+    					break;
+
+    				case CMD_ID_GET_STATS:
+    					currentState = BL_STATE_SEND_STATS;
+    					break;
+
+    				case CMD_ID_CHECKSUM:
+    					memcpy(&checksum_size, &packet_buffer[1], sizeof(checksum_size));
+    					checksum_engine = packet_buffer[5];
+    					currentState = BL_STATE_CHECKSUM;
+    					break;
+
+    				case CMD_ID_BLOCK_HASH:
+    					memcpy(&checksum_size, &packet_buffer[1], sizeof(checksum_size));
+    					currentState = BL_STATE_BLOCK_HASH;
+    					break;
+
+    				case CMD_ID_GET_IMAGE_INFO:
+    					currentState = BL_STATE_IMAGE_INFO;
+    					break;
+
+    				case CMD_ID_UPLOAD:
+    					upload_address = FLASH_BASE_ADDRESS + (((uint32_t)packet_buffer[1] & 0xFF) | (((uint32_t)packet_buffer[2] << 8) & 0xFF00) |
+    							(((uint32_t)packet_buffer[3] << 16) & 0xFF0000));
+    					upload_size = ((uint32_t)packet_buffer[4] & 0xFF) | (((uint32_t)packet_buffer[5] << 8) & 0xFF00) |
+    							(((uint32_t)packet_buffer[6] << 16) & 0xFF0000);
+    					currentState = BL_STATE_UPLOAD;
+    					break;
+
+    				case CMD_ID_SESSION:
+    					frame_size = ((uint16_t)packet_buffer[1] & 0xFF) | (((uint16_t)packet_buffer[2] << 8) & 0xFF00);
+    					flags = packet_buffer[3];
+    					currentState = BL_STATE_OPEN_SESSION;
+    					break;
+
+    				default:
+    					error_id = BL_CMD_INVALID;
+    					currentState = BL_STATE_SEND_ERROR;
+    					break;
+    			}
+    		}
+
+    		break;
+
+    	// This state comes after failing to download the new firmware, a download that failed before erasing keeps the old application
+    	case BL_STATE_ABORT:
+
+    		// Only the sectors holding data are erased, the blank ones are skipped
+    		if(app_modified == true)
+    		{
+    			erased_sectors = 0;
+    			Bootloader_EraseApplication();
+    		}
+
+    		SendError();
+    		currentState = BL_STATE_IDLE;
+
+    		break;
+
+
+    	case BL_STATE_EXECUTE:
+
+    		if(Bootloader_CheckApplicationExist() == true)
+    		{
+				SendCmdAck(CMD_ID_EXECUTE);
+				CDC_WaitTxDone_FS(TX_DONE_TIMEOUT);		// The acknowledgment must leave before the USB is reset
+    			Bootloader_JumToApplication();
+    		}
+    		else
+    		{
+    			error_id = BL_NO_USER_APP;
+    			currentState = BL_STATE_SEND_ERROR;
+    		}
+
+    		break;
+
+
+    	case BL_STATE_SEND_ERROR:
+
+    		SendError();
+    		currentState = BL_STATE_IDLE;
+
+    		break;
+
+
+    	case BL_STATE_DOWNLOAD_FW:
+
+    		SendCmdAck(CMD_ID_DOWNLOAD_FW);
+
+    		status = Bootloader_DownloadFW(total_packets);
+
+    		if(status == BL_OK)
+    		{
+        			app_total_words = (total_packets * 64) / 4;								// Calculate total words in the application
+    			status = CheckImage(app_checksum, app_total_words);						// Verify application checksum
+    		}
+
+    		if(status == BL_OK)
+    		{
+        			currentState = BL_STATE_EXECUTE;
+    		}
+    		else
+    		{
+    			error_id = status;
+    			currentState = BL_STATE_ABORT;
+    		}
+
+    		break;
+
+
+    	// Unlike BL_STATE_DOWNLOAD_FW, the windowed download returns to idle so the host decides when to execute
+    	case BL_STATE_DOWNLOAD_WIN:
+
+    		// The command is acknowledged by the download once it is ready to receive the frames
+    		status = Bootloader_StartDownloadWindowed(total_packets, session_frame_size, app_checksum,
+    				(download_cmd != CMD_ID_DOWNLOAD_WIN), (download_cmd == CMD_ID_DOWNLOAD_SYNC));
+
+    		if(status == BL_OK)
+    		{
+    			currentState = BL_STATE_RECEIVE_WIN;
+    		}
+    		else
+    		{
+    			error_id = status;
+    			currentState = BL_STATE_ABORT;
+    		}
+
+    		break;
+
+
+    	// The frames are received and programmed a pipeline pass at a time, the other tasks run in between
+    	case BL_STATE_RECEIVE_WIN:
+
+    		status = Bootloader_StepDownloadWindowed(&app_size);
+
+    		if((status == BL_BUSY) || (status == BL_WAITING))
+    		{
+    			ready = (status == BL_BUSY);
+    			break;
+    		}
+
+    		tail_start = Perf_GetCycles();
+
+    		// A full re-read is fed to the CRC unit by the DMA, the result is awaited in BL_STATE_VERIFY_APP
+    		// (or by the CPU in CheckImage if the DMA can't be started)
+    		if((status == BL_OK) && (RereadImage() == true) && (Flash_StartChecksumDMA(APP_BASE_ADDRESS, app_size / 4) == FLASH_OK))
+    		{
+    			currentState = BL_STATE_VERIFY_APP;
+    			break;
+    		}
+
+    		if(status == BL_OK)
+    		{
+    			status = CheckImage(app_checksum, app_size / 4);
+    		}
+
+    		if(status == BL_OK)
+    		{
+    			Perf_AddCycles(PERF_TAIL_CYCLES, tail_start);
+    			SendCmdAck(download_cmd);
+        			currentState = BL_STATE_IDLE;
+    		}
+    		else
+    		{
+    			error_id = status;
+    			currentState = BL_STATE_ABORT;
+    		}
+
+    		break;
+
+
+    	case BL_STATE_VERIFY_APP:
+
+    		status = Flash_GetChecksumDMA(&checksum);
+
+    		if(status == FLASH_CRC_BUSY)
+    		{
+    			break;
+    		}
+
+    		if((status == FLASH_OK) && (checksum != app_checksum))
+    		{
+    			status = BL_CHKS_MISMATCH;
+    		}
+
+    		if(status == BL_OK)
+    		{
+    			Perf_AddCycles(PERF_TAIL_CYCLES, tail_start);
+    			SendCmdAck(download_cmd);
+    			currentState = BL_STATE_IDLE;
+    		}
+    		else
+    		{
+    			error_id = (status == BL_CHKS_MISMATCH) ? BL_CHKS_MISMATCH : BL_VERIFY_FAILED;
+    			currentState = BL_STATE_ABORT;
+    		}
+
+    		break;
+
+
+    	// Checksum of the application area, starting at its base
+    	case BL_STATE_CHECKSUM:
+
+    		Perf_Reset();
+
+    		if(checksum_size > (APP_END_ADDRESS - APP_BASE_ADDRESS))
+    		{
+    			checksum_size = APP_END_ADDRESS - APP_BASE_ADDRESS;
+    		}
+
+    		checksum_start = Perf_GetCycles();
+
+    		if(checksum_engine == CHECKSUM_ENGINE_DMA)
+    		{
+    			if(Flash_StartChecksumDMA(APP_BASE_ADDRESS, checksum_size / 4) == FLASH_OK)
+    			{
+    				currentState = BL_STATE_CHECKSUM_WAIT;
+    			}
+    			else
+    			{
+    				error_id = BL_VERIFY_FAILED;
+    				currentState = BL_STATE_SEND_ERROR;
+    			}
+    		}
+    		else
+    		{
+    			checksum = Flash_GetChecksum(APP_BASE_ADDRESS, checksum_size / 4);
+    			Perf_AddCycles(PERF_CHECKSUM_CYCLES, checksum_start);
+    			SendChecksum(checksum);
+    			currentState = BL_STATE_IDLE;
+    		}
+
+    		break;
+
+
+    	// The state machine keeps running while the DMA feeds the CRC unit
+    	case BL_STATE_CHECKSUM_WAIT:
+
+    		status = Flash_GetChecksumDMA(&checksum);
+
+    		if(status == FLASH_CRC_BUSY)
+    		{
+    			perf_counters[PERF_CHECKSUM_POLLS]++;
+    		}
+    		else if(status == FLASH_OK)
+    		{
+    			Perf_AddCycles(PERF_CHECKSUM_CYCLES, checksum_start);
+    			SendChecksum(checksum);
+    			currentState = BL_STATE_IDLE;
+    		}
+    		else
+    		{
+    			error_id = BL_VERIFY_FAILED;
+    			currentState = BL_STATE_SEND_ERROR;
+    		}
+
+    		break;
+
+
+    	// Checksum of each frame size block of the application area, the host sends the blocks that differ
+    	case BL_STATE_BLOCK_HASH:
+
+    		Perf_Reset();
+
+    		if(checksum_size > (APP_END_ADDRESS - APP_BASE_ADDRESS))
+    		{
+    			checksum_size = APP_END_ADDRESS - APP_BASE_ADDRESS;
+    		}
+
+    		checksum_size -= checksum_size % 4;
+    		hash_count = (uint16_t)((checksum_size + session_frame_size - 1) / session_frame_size);
+    		hash_block = 0;
+    		checksum_start = Perf_GetCycles();
+
+    		SendBlockHashInfo(hash_count);
+    		currentState = BL_STATE_BLOCK_HASH_SEND;
+
+    		break;
+
+
+    	// The checksums are queued a batch at a time, the state is stepped again when the transmit queue drains
+    	case BL_STATE_BLOCK_HASH_SEND:
+
+    		previous_block = hash_block;
+    		hash_block = SendBlockHashes(hash_block, hash_count, checksum_size);
+    		ready = (hash_block != previous_block);
+
+    		if(hash_block >= hash_count)
+    		{
+    			Perf_AddCycles(PERF_CHECKSUM_CYCLES, checksum_start);
+    			currentState = BL_STATE_IDLE;
+    		}
+
+    		break;
+
+
+    	// The installed image is found and checksummed once, the result is kept until the application area is written
+    	case BL_STATE_IMAGE_INFO:
+
+    		Perf_Reset();
+
+    		if(image_info_valid == false)
+    		{
+    			checksum_start = Perf_GetCycles();
+    			installed_size = FindImageEnd();
+    			installed_checksum = Flash_GetChecksum(APP_BASE_ADDRESS, installed_size / 4);
+    			image_info_valid = true;
+    			Perf_AddCycles(PERF_CHECKSUM_CYCLES, checksum_start);
+    		}
+
+    		SendImageInfo(installed_size, installed_checksum);
+    		currentState = BL_STATE_IDLE;
+
+    		break;
+
+
+    	// Upload of a flash range, any range Flash_Read_Word accepts
+    	case BL_STATE_UPLOAD:
+
+    		Perf_Reset();
+
+    		if((upload_size == 0) || ((upload_size % 4) != 0) || (Flash_CheckRead(upload_address, upload_size / 4) != FLASH_OK))
+    		{
+    			error_id = BL_CMD_INVALID;
+    			currentState = BL_STATE_SEND_ERROR;
+    			break;
+    		}
+
+    		SendCmdAck(CMD_ID_UPLOAD);
+    		upload_activity = HAL_GetTick();
+    		currentState = BL_STATE_UPLOAD_SEND;
+
+    		break;
+
+
+    	// The range is copied into the transmit queue as it drains, the state is stepped again when a transfer completes:
+    	// one half of the queue is filled while the other one is on its way, see CDC_StartTx_FS
+    	case BL_STATE_UPLOAD_SEND:
+
+    		length = CDC_PeekTxBuffer_FS(&tx_buffer);
+    		length = (length > upload_size) ? (uint16_t)upload_size : length;
+
+    		// The range was checked by BL_STATE_UPLOAD, a failed read ends the stream as a timeout does
+    		if((length > 0) && (Flash_Read(upload_address, tx_buffer, length) != FLASH_OK))
+    		{
+    			CDC_FlushTxBuffer_FS();
+    			currentState = BL_STATE_IDLE;
+    			break;
+    		}
+
+    		if(length > 0)
+    		{
+    			CDC_CommitTxBuffer_FS(length);
+
+    			upload_address += length;
+    			upload_size -= length;
+    			upload_activity = HAL_GetTick();
+    			perf_counters[PERF_UPLOAD_BYTES] += length;
+    			ready = true;
+    		}
+
+    		if(upload_size == 0)
+    		{
+    			currentState = BL_STATE_IDLE;
+    		}
+    		// The upload also ends once the host stops reading, what it left queued must not precede the next response
+    		else if((HAL_GetTick() - upload_activity) > UPLOAD_TIMEOUT)
+    		{
+    			CDC_FlushTxBuffer_FS();
+    			currentState = BL_STATE_IDLE;
+    		}
+
+    		break;
+
+
+    	case BL_STATE_SEND_STATS:
+
+    		SendStats();
+    		currentState = BL_STATE_IDLE;
+
+    		break;
+
+
+    	// The frame size is kept for every windowed download until the next session is opened
+    	case BL_STATE_OPEN_SESSION:
+
+    		if(frame_size > FRAME_MAX_SIZE)
+    		{
+    			frame_size = FRAME_MAX_SIZE;
+    		}
+
+    		frame_size -= frame_size % FRAME_MIN_SIZE;
+    		session_frame_size = (frame_size < FRAME_MIN_SIZE) ? FRAME_MIN_SIZE : frame_size;
+    		session_flags = flags & SESSION_FLAGS_SUPPORTED;
+
+    		SendSessionInfo(session_frame_size, session_flags);
+    		currentState = BL_STATE_IDLE;
+
+    		break;
+
+
+    	case BL_STATE_ERASE_APP:
+
+    		// Forget what is known about the sectors, each one is blank checked again
+    		Perf_Reset();
+    		erased_sectors = 0;
+    		blank_sectors = 0;
+    		Bootloader_StartEraseApplication();
+    		currentState = BL_STATE_ERASE_WAIT;
+
+    		break;
+
+
+    	// The sectors are erased by the flash interrupt, the state is stepped again when a job completes
+    	case BL_STATE_ERASE_WAIT:
+
+    		// The counters may be polled meanwhile, the host measures how long the USB takes to answer.
+    		// Any other command stays in the ring, and the ones behind it, until the erase is over
+    		if((CDC_GetRxBufferBytesAvailable_FS() >= CMD_PACKET_SIZE) &&
+    			(CDC_PeekRxBuffer_FS(&rx_data) > 0) &&
+    			(rx_data[0] == CMD_ID_GET_STATS))
+    		{
+    			CDC_ReadRxBuffer_FS(packet_buffer, CMD_PACKET_SIZE, NO_TIMEOUT);
+    			SendStats();
+    		}
+
+    		if(Flash_IsBusy())
+    		{
+    			break;
+    		}
+
+    		// The erase ran as flash jobs only
+    		perf_counters[PERF_ERASE_CYCLES] = perf_counters[PERF_FLASH_JOB_CYCLES];
+
+    		if(erase_status != FLASH_OK)
+    		{
+    			error_id = erase_status;
+    			currentState = BL_STATE_SEND_ERROR;
+    		}
+    		else
+    		{
+				SendCmdAck(CMD_ID_ERASE_APP);
+				currentState = BL_STATE_IDLE;
+    		}
+
+    		break;
+
+
+    	default:
+
+    		error_id = BL_INVALID_STATE;
+    		currentState = BL_STATE_SEND_ERROR;
+
+    		break;
+    }
+
+    previousState = state;
+
+    // A new state is stepped at once, so that a command sent right after the response is not flushed
+    return ready || (currentState != state);
+}
+
+/**
+ * @brief	Jumps to the user application
+ * @param	None
+ * @return	None
+ */
+void Bootloader_JumToApplication(void)
+{
+    uint32_t application_entry_point_address = *(volatile uint32_t *)(APP_BASE_ADDRESS + 4);
+
+    pFunction application_entry_point = (pFunction)application_entry_point_address ;
+
+    // Reset peripherals
+    HAL_RCC_DeInit();
+    HAL_DeInit();
+
+    // Reset Systick
+    SysTick->CTRL = 0;  // Disable SysTick
+    SysTick->VAL = 0;   // Reset current value
+    SysTick->LOAD = 0;  // Reset reload value
+
+    // Set the vector table base address
+    SCB->VTOR = APP_BASE_ADDRESS;
+
+    // Set the stack pointer
+    __set_MSP(*(volatile uint32_t*)(APP_BASE_ADDRESS));
+
+    // Jump to the application
+    application_entry_point();
+}
+
+/**
+ * @brief	Checks if a user application exists in the flash memory.
+ * @param	None
+ * @return	True if a user application exists, false otherwise.
+ */
+bool Bootloader_CheckApplicationExist(void)
+{
+    uint32_t stack_address = 0;
+
+    Flash_Read_Word(APP_BASE_ADDRESS, &stack_address, (uint32_t)1);
+
+    if ((stack_address < RAM_BASE_ADDRESS) || ((stack_address - RAM_BASE_ADDRESS) > RAM_SIZE))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief	This function erases the application area in flash memory.
+ * @param	None
+ * @return	Flash error code: e_Flash_Status
+ *			- FLASH_ERASE_ERROR: The erase operation failed.
+ *			- FLASH_OK: The erase operation was successful.
+ */
+uint8_t Bootloader_EraseApplication(void)
+{
+	uint8_t status = FLASH_OK;
+
+	for(uint8_t sector_num = APP_START_SECTOR; sector_num < FLASH_TOTAL_SECTORS; sector_num++)
+	{
+		status = Bootloader_EraseAppSector(sector_num);
+
+		if(status != FLASH_OK)
+		{
+	    	break;
+		}
+	}
+
+    return status;
+}
+
+/**
+ * @brief	This function starts erasing the application area and returns at once. The sectors failing
+ * 			their blank check are queued to the flash driver, which erases them from its interrupt:
+ * 			the erase is over once Flash_IsBusy returns false, erase_status then holds its result.
+ * @param	None
+ * @return	None
+ */
+void Bootloader_StartEraseApplication(void)
+{
+	uint8_t status = FLASH_OK;
+	uint8_t pending = 0;
+
+	erase_status = FLASH_OK;
+	image_info_valid = false;
+
+	// The blank sectors are all recorded before the first erase completes in the interrupt
+	for(uint8_t sector_num = APP_START_SECTOR; sector_num < FLASH_TOTAL_SECTORS; sector_num++)
+	{
+		if(IsSectorBlank(sector_num) == true)
+		{
+			perf_counters[PERF_ERASES_SKIPPED]++;
+			erased_sectors |= (1U << sector_num);
+			blank_sectors |= (1U << sector_num);
+		}
+		else
+		{
+			pending |= (1U << sector_num);
+			erase_tries[sector_num] = ERASE_TRIES;
+		}
+	}
+
+	for(uint8_t sector_num = APP_START_SECTOR; (sector_num < FLASH_TOTAL_SECTORS) && (status == FLASH_OK); sector_num++)
+	{
+		if(pending & (1U << sector_num))
+		{
+			app_modified = true;
+			status = Flash_QueueErase(sector_num, EraseSectorDone);
+		}
+	}
+
+	if(status != FLASH_OK)
+	{
+		erase_status = status;
+	}
+}
+
+/**
+ * @brief	This function erases one sector of the application area and records it as erased.
+ * 			The erase is skipped if the sector is known to be blank or passes a blank check.
+ * @param	sector: The sector number to be erased.
+ * @return	Flash error code: e_Flash_Status
+ *			- FLASH_ERASE_ERROR: The erase operation failed.
+ *			- FLASH_OK: The erase operation was successful.
+ */
+uint8_t Bootloader_EraseAppSector(uint8_t sector)
+{
+	uint8_t status = FLASH_OK;
+	uint8_t try = ERASE_TRIES;
+	uint32_t cycles;
+
+	image_info_valid = false;
+
+	if(IsSectorBlank(sector) == true)
+	{
+		perf_counters[PERF_ERASES_SKIPPED]++;
+	}
+	else
+	{
+		cycles = Perf_GetCycles();
+
+		do
+		{
+			status = Flash_EraseSector(sector);
+
+		} while((status != FLASH_OK) && --try);
+
+		Perf_AddCycles(PERF_ERASE_CYCLES, cycles);
+
+		app_modified = true;
+		perf_counters[PERF_ERASED_SECTORS] |= (1U << sector);
+	}
+
+	if(status == FLASH_OK)
+	{
+		erased_sectors |= (1U << sector);
+		blank_sectors |= (1U << sector);
+	}
+
+	return status;
+}
+
+/**
+ * @brief	This function erases the sectors covering an address range that were not erased yet
+ * 			by the current operation, so only the sectors an image actually uses are erased,
+ * 			each one just before its first write.
+ * @param	address: The start address of the range.
+ * @param	size: The size of the range in bytes.
+ * @return	Flash error code: e_Flash_Status
+ *			- FLASH_WRITE_OVER_ERROR: The range is outside of the application area.
+ *			- FLASH_ERASE_ERROR: The erase operation failed.
+ *			- FLASH_OK: The range is erased.
+ */
+uint8_t Bootloader_PrepareFlash(uint32_t address, uint32_t size)
+{
+	uint8_t status = FLASH_OK;
+	uint8_t first_sector = Flash_GetSector(address);
+	uint8_t last_sector = Flash_GetSector(address + size - 1);
+
+	if((size == 0) || (first_sector < APP_START_SECTOR) || (last_sector >= FLASH_TOTAL_SECTORS))
+	{
+		return (size == 0) ? FLASH_OK : FLASH_WRITE_OVER_ERROR;
+	}
+
+	// Every write to the application area goes through here first
+	image_info_valid = false;
+
+	for(uint8_t sector_num = first_sector; sector_num <= last_sector; sector_num++)
+	{
+		if((erased_sectors & (1U << sector_num)) == 0)
+		{
+			status = Bootloader_EraseAppSector(sector_num);
+
+			if(status != FLASH_OK)
+			{
+				break;
+			}
+		}
+
+		// The range is about to be programmed
+		blank_sectors &= ~(1U << sector_num);
+	}
+
+	app_modified = true;
+
+	return status;
+}
+
+/**
+ * @brief	Downloads the firmware packets and writes them to the flash memory.
+ * @param	The total number of firmware packets to download.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_DOWNLOAD_FAILED: Failed to download the new firmware.
+ *			- BL_OK: The download operation was successful.
+ */
+uint8_t Bootloader_DownloadFW(uint16_t total_packets)
+{
+	uint8_t status;
+	uint8_t try_nb = 3;
+	uint16_t packet_num = 0;
+	uint16_t packet_size = 64;
+	uint16_t packet_total_words = packet_size / 4; // 64/4
+	uint32_t rcv_timeout = 2000;
+	uint32_t address = APP_BASE_ADDRESS;
+
+	Perf_Reset();
+
+	// The flash stays unlocked for the whole download
+	if(Flash_Open() != FLASH_OK)
+	{
+		return BL_DOWNLOAD_FAILED;
+	}
+
+	// Sectors are erased just before their first write
+	app_modified = false;
+	erased_sectors = 0;
+	image_crc = CRC_INITIAL_VALUE;
+	download.segmented = false;
+	status = BL_OK;
+
+	do
+	{
+		status = CDC_ReadRxBuffer_FS(packet_buffer, 64, rcv_timeout);
+
+		if(status == USBD_OK)
+		{
+			SendPacketAck(packet_num);
+			status = Bootloader_PrepareFlash(address, packet_size);
+
+			if(status != FLASH_OK)
+			{
+				break;
+			}
+
+			status = ProgramFlash(address, (uint32_t *)packet_buffer, packet_total_words);
+
+			if(status == FLASH_OK)
+			{
+				status = VerifyFlash(address, (uint32_t *)packet_buffer, packet_total_words, NULL);
+				image_crc = Flash_ResumeChecksum(image_crc, address, packet_total_words);
+			}
+
+			if(status != FLASH_OK)
+			{
+				break;
+			}
+
+			address = address + packet_size;
+			packet_num ++;
+			try_nb = 3;
+
+			//while(CDC_Transmit_FS(packet_buffer, 64) == USBD_BUSY);
+		}
+		else if(try_nb > 0)
+		{
+			SendPacketNAck(packet_num);
+			try_nb --;
+		}
+		else
+		{
+			break;
+		}
+
+	} while(packet_num < total_packets);
+
+	if(packet_num != total_packets)
+	{
+		status = BL_DOWNLOAD_FAILED;
+	}
+	else
+	{
+		// This download blocks anyway, it waits for the erases it queued
+		StartEraseImageTail((uint32_t)total_packets * packet_size);
+
+		while(Flash_IsBusy());
+
+		perf_counters[PERF_ERASE_CYCLES] += perf_counters[PERF_FLASH_JOB_CYCLES];
+
+		if(erase_status != FLASH_OK)
+		{
+			status = BL_DOWNLOAD_FAILED;
+		}
+	}
+
+	Flash_Close();
+
+    return status;
+}
+
+/**
+ * @brief	Starts a download of the firmware as frames using a sliding window with selective repeat.
+ *
+ * 			Each frame carries its sequence number, its length and the CRC of its payload.
+ * 			Frames go through a pipeline of PIPELINE_SLOTS buffers: while one buffer is
+ * 			programmed PROGRAM_STEP_WORDS at a time, the next frame is moved from the receive
+ * 			ring into another one and checked, so the transfer overlaps the programming.
+ * 			A frame is written at its own offset whatever the order of arrival. Every frame
+ * 			committed to flash is answered with a cumulative acknowledgment (first frame not
+ * 			committed) plus a bitmap of the frames committed after it, letting the host resend
+ * 			only the missing ones. A receive timeout, a corrupted frame or a desynchronized
+ * 			stream is answered with a non-acknowledgment of the base so the host resends the
+ * 			frames still missing.
+ *
+ * 			With SESSION_FLAG_STAGED, frames are committed to a RAM staging area instead of
+ * 			flash, at link speed. An image that fits in the staging area has its CRC verified
+ * 			in RAM before the application is erased, so a corrupted transfer never costs an
+ * 			erase. A larger image is handled chunk by chunk: each chunk, made of frames already
+ * 			verified by their CRC, is programmed once complete. Frames beyond the current chunk
+ * 			are dropped and requested again once the chunk has been programmed.
+ *
+ * 			With SESSION_FLAG_ZERO_COPY, every frame is padded by the host to FRAME_BLOCK_SIZE so
+ * 			frames start on a USB packet. The OUT endpoint then receives each frame in place into
+ * 			the next slot, queued in order to the CDC interface: the frame reaches the programming
+ * 			without going through the receive ring. A rejected slot is kept in the pipeline order
+ * 			and queued again once the slots before it are programmed.
+ *
+ * 			Every frame ends with a short USB packet, or fills its block exactly in zero-copy mode,
+ * 			so the OUT endpoint is armed for RX_TRANSFER_SIZE at once unless SESSION_FLAG_SINGLE_PACKET
+ * 			is set: one receive callback per transfer instead of one per packet. The host flags
+ * 			FRAME_FLAG_FILL a frame that would end on a packet boundary and sends a filler word
+ * 			after its payload, skipped here: otherwise its transfer would only complete with the
+ * 			next frame.
+ *
+ * 			A segmented download (DOWNLOAD_SEG) sends only the segments of the image: every frame
+ * 			carries the frame size block it is written to and may be shorter than the frame size.
+ * 			The blocks between the segments are neither sent nor programmed, the sectors they lie in
+ * 			are erased so they read as blank. The image checksum covers the frames in sequence order.
+ * 			The segments can't go through the staging area, which holds a contiguous chunk.
+ *
+ * 			A sync download (DOWNLOAD_SYNC) is a segmented download of the blocks that changed, the
+ * 			blocks not sent keep their content: no gap is erased, and the sector fitting in the
+ * 			staging area is copied there before its erase, see KeepSector, its blocks not written
+ * 			are programmed back at the end. The host sends every block of the larger sectors it
+ * 			changes. The image checksum covers the frames sent, the host checks the whole image.
+ *
+ * 			A frame flagged FRAME_FLAG_COMPRESSED carries its data LZSS compressed, on its own so
+ * 			it is decompressed as soon as it is accepted, whatever the order of arrival, and goes
+ * 			through the pipeline as the frames sent uncompressed. The host sends uncompressed the
+ * 			frames compression doesn't shrink.
+ *
+ * 			A frame flagged FRAME_FLAG_DELTA carries a patch rebuilding it from the installed
+ * 			application, see PatchFrame. The host builds the patches of a frame from the sectors the
+ * 			frames before it leave intact, but a later frame may be programmed first: a patch copying
+ * 			from a sector the download has already overwritten is refused with CMD_ID_DELTA_NACK, and
+ * 			the host sends the frame again unpatched. In store-and-forward mode
+ * 			the whole chunk is patched before it is programmed, so the patches of a chunk can copy
+ * 			from the sectors it replaces.
+ *
+ * 			Once every frame is committed, the sectors past the end of the image still holding data
+ * 			are queued to the flash driver, see StartEraseImageTail, and the download ends once
+ * 			they are erased. A sync download leaves them, the host only syncs an image at least
+ * 			as long as the installed one.
+ *
+ * 			The download then runs in steps of Bootloader_StepDownloadWindowed, one pass of the
+ * 			pipeline each, so the other tasks run between two steps.
+ * 			The download command is acknowledged once the download is ready to receive.
+ * @param	total_frames: The total number of frames to download.
+ * @param	frame_size: The negotiated frame size, only the last frame may be shorter.
+ * @param	app_checksum: The expected checksum of the whole image.
+ * @param	segmented: True if the frames carry their block, for a DOWNLOAD_SEG or DOWNLOAD_SYNC command.
+ * @param	keep_blocks: True if the blocks not sent keep their content, for a DOWNLOAD_SYNC command.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_CMD_INVALID: Segmented download requested in store-and-forward mode.
+ * 			- BL_DOWNLOAD_FAILED: The flash couldn't be unlocked.
+ *			- BL_OK: The download is started.
+ */
+uint8_t Bootloader_StartDownloadWindowed(uint16_t total_frames, uint16_t frame_size, uint32_t app_checksum, bool segmented, bool keep_blocks)
+{
+	if((segmented || keep_blocks) && (session_flags & SESSION_FLAG_STAGED))
+	{
+		return BL_CMD_INVALID;
+	}
+
+	Perf_Reset();
+
+	memset(&download, 0, sizeof(download));
+	download.start = Perf_GetCycles();
+	download.total_frames = total_frames;
+	download.frame_size = frame_size;
+	download.app_checksum = app_checksum;
+	download.window = GetWindowSize(frame_size);
+	download.chunk_frames = STAGING_SIZE / frame_size;
+	download.zero_copy = ((session_flags & SESSION_FLAG_ZERO_COPY) != 0);
+	download.segmented = segmented || keep_blocks;
+	download.keep_blocks = keep_blocks;
+	download.kept_sector = FLASH_TOTAL_SECTORS;
+
+	image_crc = CRC_INITIAL_VALUE;
+
+	for(uint8_t i = 0; i < PIPELINE_SLOTS; i++)
+	{
+		frame_slots[i].state = SLOT_FREE;
+	}
+
+	// The flash stays unlocked for the whole download
+	if(Flash_Open() != FLASH_OK)
+	{
+		return BL_DOWNLOAD_FAILED;
+	}
+
+	// Sectors are erased just before their first write, in store-and-forward mode once the data has been verified
+	app_modified = false;
+	erased_sectors = 0;
+
+	CDC_SetRxTransferSize_FS((session_flags & SESSION_FLAG_SINGLE_PACKET) ? CDC_DATA_FS_OUT_PACKET_SIZE : RX_TRANSFER_SIZE);
+
+	// The frames are received in place into the slots, handed in order to the CDC interface
+	if(download.zero_copy)
+	{
+		CDC_StartRxBlocks_FS(FRAME_BLOCK_SIZE(frame_size));
+
+		for(uint8_t i = 0; i < PIPELINE_SLOTS; i++)
+		{
+			CDC_QueueRxBlock_FS(frame_slots[i].header);
+		}
+	}
+
+	SendCmdAck(keep_blocks ? CMD_ID_DOWNLOAD_SYNC : (segmented ? CMD_ID_DOWNLOAD_SEG : CMD_ID_DOWNLOAD_WIN));
+
+	download.last_activity = HAL_GetTick();
+
+	return BL_OK;
+}
+
+/**
+ * @brief	Runs one pass of the windowed download pipeline: a receive stage then a program stage.
+ * 			It never waits, a pass with nothing to receive nor to program returns BL_WAITING.
+ * @param	image_size: Set to the size of the downloaded image in bytes once the download ends.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_BUSY: The download goes on, the pass did some work.
+ * 			- BL_WAITING: The download goes on, waiting for the host.
+ * 			- BL_DOWNLOAD_FAILED: Failed to download the new firmware.
+ *			- BL_OK: The download operation was successful.
+ */
+uint8_t Bootloader_StepDownloadWindowed(uint32_t *image_size)
+{
+	uint8_t status;
+	uint16_t previous_base;
+	uint16_t offset;
+	uint16_t available;
+	uint16_t length;
+	uint32_t rcv_timeout = 2000;
+	uint32_t end;
+	uint32_t cycles;
+	uint32_t excluded_cycles;			// Erase and verify cycles, accounted apart from the programming
+	bool progress;
+	bool whole_image;
+	uint8_t *block;
+	s_Frame_Slot *slot;
+
+	*image_size = download.image_size;
+
+	if(download.base >= download.total_frames)
+	{
+		// The blocks of the kept sector not sent are programmed back, the other sectors were not erased.
+		// The image may end past the last block sent, the host doesn't sync an image shorter than the installed one
+		if(download.keep_blocks)
+		{
+			return EndDownloadWindowed(RestoreKeptBlocks());
+		}
+
+		// The task is stepped again by SCHED_EVENT_FLASH as each erase completes
+		if(download.tail_queued == false)
+		{
+			// The sectors lying only in the gaps between the segments haven't been erased yet
+			if(download.segmented && (Bootloader_PrepareFlash(APP_BASE_ADDRESS, download.image_size) != FLASH_OK))
+			{
+				return EndDownloadWindowed(BL_DOWNLOAD_FAILED);
+			}
+
+			StartEraseImageTail(download.image_size);
+			download.tail_queued = true;
+		}
+
+		if(Flash_IsBusy())
+		{
+			return BL_WAITING;
+		}
+
+		// The tail erases are the only flash jobs of the download
+		perf_counters[PERF_ERASE_CYCLES] += perf_counters[PERF_FLASH_JOB_CYCLES];
+
+		return EndDownloadWindowed((erase_status == FLASH_OK) ? BL_OK : BL_DOWNLOAD_FAILED);
+	}
+
+	/* Receive stage: move what the ring holds into the filling slot */
+
+	cycles = Perf_GetCycles();
+	progress = false;
+	slot = &frame_slots[download.filling];
+	available = download.zero_copy ? 0 : CDC_GetRxBufferBytesAvailable_FS();
+
+	// In zero-copy mode the whole frame is already in the slot once its block is complete
+	if(download.zero_copy && (slot->state == SLOT_FREE) && ((length = CDC_GetRxBlock_FS(&block)) > 0))
+	{
+		progress = true;
+
+		// Lost synchronization with the frame stream: the next packet starts a new block, let the host resend
+		if((ReadFrameHeader(slot, block, download.frame_size) == false) || (length < (FRAME_HEADER_SIZE + slot->length)))
+		{
+			CDC_FlushRxBuffer_FS();
+			SendPacketNAck(download.base);
+			slot->state = SLOT_DROPPED;
+			download.filling = (download.filling + 1) % PIPELINE_SLOTS;
+		}
+		else
+		{
+			slot->count = slot->length;
+			slot->state = SLOT_FILLING;
+		}
+	}
+	else if((slot->state == SLOT_FREE) && (available >= FRAME_HEADER_SIZE))
+	{
+		CDC_ReadRxBuffer_FS(packet_buffer, FRAME_HEADER_SIZE, NO_TIMEOUT);
+		available -= FRAME_HEADER_SIZE;
+		progress = true;
+
+		// Lost synchronization with the frame stream: drop everything and let the host resend
+		if(ReadFrameHeader(slot, packet_buffer, download.frame_size) == false)
+		{
+			CDC_FlushRxBuffer_FS();
+			SendPacketNAck(download.base);
+			available = 0;
+		}
+		else
+		{
+			slot->count = 0;
+			slot->state = SLOT_FILLING;
+		}
+	}
+
+	if((slot->state == SLOT_FILLING) && (available > 0))
+	{
+		length = FrameReceiveSize(slot) - slot->count;
+		length = (available < length) ? available : length;
+
+		CDC_ReadRxBuffer_FS((uint8_t *)slot->data + slot->count, length, NO_TIMEOUT);
+		slot->count += length;
+		progress = true;
+	}
+
+	if((slot->state == SLOT_FILLING) && (slot->count == FrameReceiveSize(slot)))
+	{
+		slot->state = SLOT_FREE;
+		offset = (uint16_t)(slot->seq - download.base);
+
+		// A frame must match the CRC sent in its header
+		if(Flash_GetChecksum((uint32_t)slot->data, slot->length / 4) != slot->crc)
+		{
+			SendPacketNAck(download.base);
+		}
+		// A duplicate or a frame outside the receive window (or staging area) is only acknowledged
+		else if((slot->seq < download.base) || (slot->seq >= download.total_frames) || (offset >= download.window) ||
+				((download.accepted & (1UL << offset)) != 0) ||
+				((session_flags & SESSION_FLAG_STAGED) && (slot->seq >= (download.chunk_first + download.chunk_frames))))
+		{
+			SendWindowAck(download.base, download.committed >> 1);
+		}
+		// The data the patch copies is gone when a later frame arrived first, the host sends this one unpatched
+		else if((slot->flags & FRAME_FLAG_DELTA) && ((status = PatchFrame(slot, download.frame_size)) != BL_OK))
+		{
+			if(status == BL_DELTA_SOURCE_LOST)
+			{
+				SendDeltaNAck(slot->seq);
+			}
+			else
+			{
+				SendPacketNAck(download.base);
+			}
+		}
+		// A compressed frame is decompressed once accepted, then only the last frame, or the last one of a segment, may be shorter
+		else if(((slot->flags & FRAME_FLAG_COMPRESSED) && (InflateFrame(slot, download.frame_size) == false)) ||
+				((download.segmented == false) && (slot->seq != (download.total_frames - 1)) && (slot->length != download.frame_size)))
+		{
+			SendPacketNAck(download.base);
+		}
+		// Queue the frame for programming
+		else
+		{
+			download.accepted |= (1UL << offset);
+			slot->count = 0;
+			slot->state = SLOT_READY;
+			download.filling = (download.filling + 1) % PIPELINE_SLOTS;
+		}
+
+		// A rejected zero-copy slot keeps its turn, the CDC interface fills the slots in order
+		if(download.zero_copy && (slot->state == SLOT_FREE))
+		{
+			slot->state = SLOT_DROPPED;
+			download.filling = (download.filling + 1) % PIPELINE_SLOTS;
+		}
+	}
+
+	if(progress)
+	{
+		download.timeouts = 0;
+		download.last_activity = HAL_GetTick();
+		cycles = Perf_AddCycles(PERF_RECEIVE_CYCLES, cycles);
+	}
+
+	/* Program stage: program a step of the oldest ready slot */
+
+	slot = &frame_slots[download.programming];
+
+	if(slot->state == SLOT_DROPPED)
+	{
+		slot->state = SLOT_FREE;
+		CDC_QueueRxBlock_FS(slot->header);
+		download.programming = (download.programming + 1) % PIPELINE_SLOTS;
+		slot = &frame_slots[download.programming];
+	}
+
+	if((slot->state == SLOT_READY) && (session_flags & SESSION_FLAG_STAGED))
+	{
+		offset = (uint16_t)(slot->seq - download.chunk_first);
+		length = slot->length;
+
+		memcpy((uint8_t *)staging_buffer + ((uint32_t)offset * download.frame_size), slot->data, length);
+
+		if((((uint32_t)offset * download.frame_size) + length) > download.staged_size)
+		{
+			download.staged_size = ((uint32_t)offset * download.frame_size) + length;
+		}
+	}
+	else if(slot->state == SLOT_READY)
+	{
+		length = slot->length - slot->count;
+		length = (length > (PROGRAM_STEP_WORDS * 4)) ? (PROGRAM_STEP_WORDS * 4) : length;
+		excluded_cycles = perf_counters[PERF_ERASE_CYCLES];
+
+		if(download.keep_blocks)
+		{
+			KeepSector(BlockAddress(slot->block) + slot->count);
+		}
+
+		if((Bootloader_PrepareFlash(BlockAddress(slot->block) + slot->count, length) != FLASH_OK) ||
+			(ProgramFlash(BlockAddress(slot->block) + slot->count,
+				&slot->data[slot->count / 4], length / 4) != FLASH_OK))
+		{
+			return EndDownloadWindowed(BL_DOWNLOAD_FAILED);
+		}
+
+		// An erase done by this step is accounted apart from the programming
+		cycles += perf_counters[PERF_ERASE_CYCLES] - excluded_cycles;
+	}
+
+	if(slot->state == SLOT_READY)
+	{
+		slot->count += length;
+
+		// The transfer is overlapped if the next frame is arriving meanwhile
+		if((frame_slots[download.filling].state == SLOT_FILLING) || (CDC_GetRxBufferBytesAvailable_FS() > 0) || CDC_IsRxBlockPending_FS())
+		{
+			perf_counters[PERF_PROGRAM_OVERLAP_CYCLES] += Perf_GetCycles() - cycles;
+		}
+
+		cycles = Perf_AddCycles(PERF_PROGRAM_CYCLES, cycles);
+
+		if(slot->count == slot->length)
+		{
+			// Check the frame against its CRC, the staging area is checked chunk by chunk
+			if(((session_flags & SESSION_FLAG_STAGED) == 0) &&
+				(VerifyFlash(BlockAddress(slot->block), slot->data, slot->length / 4,
+						(slot->flags & (FRAME_FLAG_COMPRESSED | FRAME_FLAG_DELTA)) ? NULL : &slot->crc) != FLASH_OK))
+			{
+				return EndDownloadWindowed(BL_VERIFY_FAILED);
+			}
+
+			offset = (uint16_t)(slot->seq - download.base);
+			download.committed |= (1UL << offset);
+			download.blocks[slot->seq % WIN_MAX_SIZE] = slot->block;
+			download.lengths[slot->seq % WIN_MAX_SIZE] = slot->length;
+
+			if(download.keep_blocks)
+			{
+				MarkBlockWritten(slot->block);
+			}
+
+			// The image ends with the frame written the furthest, the last one unless segmented
+			end = ((uint32_t)slot->block * download.frame_size) + slot->length;
+
+			if(end > download.image_size)
+			{
+				download.image_size = end;
+				*image_size = download.image_size;
+			}
+
+			// Slide the window over the frames committed in sequence
+			previous_base = download.base;
+
+			while(download.committed & 1)
+			{
+				download.committed >>= 1;
+				download.accepted >>= 1;
+				download.base++;
+			}
+
+			// Feed the frames now in sequence to the image CRC, the staging area is fed chunk by chunk
+			for(uint16_t seq = previous_base; ((session_flags & SESSION_FLAG_STAGED) == 0) && (seq != download.base); seq++)
+			{
+				image_crc = Flash_ResumeChecksum(image_crc, BlockAddress(download.blocks[seq % WIN_MAX_SIZE]),
+						download.lengths[seq % WIN_MAX_SIZE] / 4);
+			}
+
+			perf_counters[PERF_FRAMES]++;
+			SendWindowAck(download.base, download.committed >> 1);
+
+			// A complete chunk leaves the staging area for flash
+			if((session_flags & SESSION_FLAG_STAGED) &&
+				((download.base == download.total_frames) || (download.base == (download.chunk_first + download.chunk_frames))))
+			{
+				excluded_cycles = perf_counters[PERF_ERASE_CYCLES] + perf_counters[PERF_VERIFY_CYCLES];
+				image_crc = Flash_ResumeChecksum(image_crc, (uint32_t)staging_buffer, download.staged_size / 4);
+				whole_image = ((download.chunk_first == 0) && (download.base == download.total_frames));
+
+				// An image held whole by the staging area is checked before anything is erased
+				if((whole_image == true) && (image_crc != download.app_checksum))
+				{
+					return EndDownloadWindowed(BL_CHKS_MISMATCH);
+				}
+
+				status = Bootloader_ProgramStaged(APP_BASE_ADDRESS + ((uint32_t)download.chunk_first * download.frame_size), download.staged_size,
+						(whole_image == true) ? &download.app_checksum : NULL);
+
+				if(status != BL_OK)
+				{
+					return EndDownloadWindowed(status);
+				}
+
+				download.chunk_first = download.base;
+				download.staged_size = 0;
+				cycles += perf_counters[PERF_ERASE_CYCLES] + perf_counters[PERF_VERIFY_CYCLES] - excluded_cycles;
+				cycles = Perf_AddCycles(PERF_PROGRAM_CYCLES, cycles);
+
+				// Request the frames dropped while the chunk was completing
+				if(download.base < download.total_frames)
+				{
+					SendPacketNAck(download.base);
+				}
+			}
+
+			slot->state = SLOT_FREE;
+			download.programming = (download.programming + 1) % PIPELINE_SLOTS;
+			download.last_activity = HAL_GetTick();
+
+			if(download.zero_copy)
+			{
+				CDC_QueueRxBlock_FS(slot->header);
+			}
+		}
+	}
+	else if((HAL_GetTick() - download.last_activity) > rcv_timeout)
+	{
+		if(++download.timeouts > WIN_MAX_TIMEOUTS)
+		{
+			return EndDownloadWindowed(BL_DOWNLOAD_FAILED);
+		}
+
+		// Drop the partial frame and ask the host to resend every frame not committed yet
+		if(frame_slots[download.filling].state == SLOT_FILLING)
+		{
+			frame_slots[download.filling].state = SLOT_FREE;
+		}
+
+		CDC_FlushRxBuffer_FS();
+		SendPacketNAck(download.base);
+		download.last_activity = HAL_GetTick();
+	}
+	else
+	{
+		Perf_AddCycles(PERF_WAIT_CYCLES, cycles);
+
+		if(progress == false)
+		{
+			return BL_WAITING;
+		}
+	}
+
+	return BL_BUSY;
+}
+
+/**
+ * @brief	Programs a chunk of the staging area into the application area.
+ * @param	address: The flash address of the chunk.
+ * @param	size: The size of the chunk in bytes.
+ * @param	crc: The known CRC of the chunk used to verify it, NULL to compute it from the staging area.
+ * @return	Bootloader status code: e_Bootloader_Status
+ * 			- BL_DOWNLOAD_FAILED: Erasing or programming the flash failed.
+ * 			- BL_VERIFY_FAILED: The programmed chunk doesn't match the staging area.
+ *			- BL_OK: The chunk was programmed.
+ */
+uint8_t Bootloader_ProgramStaged(uint32_t address, uint32_t size, const uint32_t *crc)
+{
+	if(Bootloader_PrepareFlash(address, size) != FLASH_OK)
+	{
+		return BL_DOWNLOAD_FAILED;
+	}
+
+	if(ProgramFlash(address, staging_buffer, size / 4) != FLASH_OK)
+	{
+		return BL_DOWNLOAD_FAILED;
+	}
+
+	if(VerifyFlash(address, staging_buffer, size / 4, crc) != FLASH_OK)
+	{
+		return BL_VERIFY_FAILED;
+	}
+
+	return BL_OK;
 }
 
 /**
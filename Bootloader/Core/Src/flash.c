@@ -8,13 +8,57 @@
 #include <string.h>
 
 #include "flash.h"
+#include "perf.h"
+#include "sched.h"
 #include "stm32f4xx_hal.h"
 #include "stm32f4xx_hal_flash.h"
 
 
+/* Private typedef --------------------------------------------------------*/
+
+typedef struct
+{
+	uint8_t sector;										// Sector to erase
+	pFlash_Callback callback;							// Called on completion, may be NULL
+
+} s_Flash_Job;
+
+
 /* Imported variables -----------------------------------------------------*/
 
 extern CRC_HandleTypeDef hcrc;
+extern DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
+
+
+/* Private variables ------------------------------------------------------*/
+
+static bool flash_open = false;							// Set while a programming session keeps the flash unlocked
+
+static volatile uint32_t crc_dma_address;				// Next word fed to the CRC unit by the DMA
+static volatile uint32_t crc_dma_remaining = 0;			// Words left to feed after the running transfer
+static volatile uint8_t crc_dma_status = FLASH_OK;		// FLASH_CRC_BUSY while a DMA fed checksum runs
+
+static s_Flash_Job flash_jobs[FLASH_JOB_QUEUE_SIZE];	// Job queue, the running job is the oldest one
+static volatile uint8_t flash_job_head = 0;				// Next free entry of the queue
+static volatile uint8_t flash_job_tail = 0;				// Running job, or the next one to start
+static volatile bool flash_job_running = false;			// Set while the flash is busy with the job at the tail
+static volatile bool flash_job_event = false;			// Set by the HAL callbacks when an operation ends
+static volatile uint8_t flash_job_status = FLASH_OK;	// Error reported by the HAL for the running operation
+static uint32_t flash_job_start = 0;					// Cycle count when the running job started
+static bool flash_job_unlocked = false;					// Set if the flash was unlocked for the jobs only
+
+// Base address of each sector, followed by the end of the flash
+static const uint32_t sector_addresses[FLASH_TOTAL_SECTORS + 1] =
+{
+	FLASH_SECTOR_0_ADDRESS, FLASH_SECTOR_1_ADDRESS, FLASH_SECTOR_2_ADDRESS, FLASH_SECTOR_3_ADDRESS,
+	FLASH_SECTOR_4_ADDRESS, FLASH_SECTOR_5_ADDRESS, FLASH_SECTOR_6_ADDRESS, FLASH_SECTOR_7_ADDRESS,
+	FLASH_BASE_ADDRESS + FLASH_SIZE
+};
+
+
+/* Private function prototypes --------------------------------------------*/
+
+static void Flash_EndJob(uint8_t status);
 
 
 /* Functions --------------------------------------------------------------*/
@@ -40,9 +84,50 @@ uint8_t Flash_Init(void)
 
     HAL_FLASH_Lock();
 
+    // The asynchronous jobs step in the flash interrupt
+    HAL_NVIC_SetPriority(FLASH_IRQn, FLASH_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
     return FLASH_OK;
 }
 
+/**
+ * @brief	This function opens a programming session: the flash is unlocked once and the
+ * 			program parallelism set to words, as required by the 2.7 V - 3.6 V voltage range.
+ * @param	None
+ * @return	Flash error code ::eFlashErrorCodes
+ *			- FLASH_UNL_ERROR: Flash unlocking failed.
+ *			- FLASH_OK: The session is open.
+ */
+uint8_t Flash_Open(void)
+{
+    if (HAL_FLASH_Unlock() != HAL_OK)
+    {
+    	return FLASH_UNL_ERROR;
+    }
+
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+    		FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+    MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE, FLASH_PSIZE_WORD);
+
+    flash_open = true;
+
+    return FLASH_OK;
+}
+
+/**
+ * @brief	This function closes the programming session and locks the flash.
+ * @param	None
+ * @return	None
+ */
+void Flash_Close(void)
+{
+	flash_open = false;
+
+	HAL_FLASH_Lock();
+}
+
 /**
  * @brief	This function erases a specified flash sector.
  * @param 	sector: The sector number to be erased.
@@ -56,7 +141,10 @@ uint8_t Flash_EraseSector(uint8_t sector)
     uint32_t SectorError;
     uint8_t flash_status = FLASH_OK;
 
-    HAL_FLASH_Unlock();
+    if (flash_open == false)
+    {
+    	HAL_FLASH_Unlock();
+    }
 
     // Configure the erase operation
     eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
@@ -70,11 +158,93 @@ uint8_t Flash_EraseSector(uint8_t sector)
     	flash_status = FLASH_ERASE_ERROR;
     }
 
-    HAL_FLASH_Lock();
+    if (flash_open == false)
+    {
+    	HAL_FLASH_Lock();
+    }
 
     return flash_status;
 }
 
+/**
+ * @brief	This function finds the sector holding a flash address.
+ * @param 	address: The flash address.
+ * @return	The sector number, FLASH_TOTAL_SECTORS if the address is outside of the flash.
+ */
+uint8_t Flash_GetSector(uint32_t address)
+{
+	uint8_t sector = 0;
+
+	if(address < FLASH_BASE_ADDRESS)
+	{
+		return FLASH_TOTAL_SECTORS;
+	}
+
+	while((sector < FLASH_TOTAL_SECTORS) && (address >= sector_addresses[sector + 1]))
+	{
+		sector++;
+	}
+
+	return sector;
+}
+
+/**
+ * @brief	This function gives the base address of a sector.
+ * @param 	sector: The sector number, FLASH_TOTAL_SECTORS for the end of the flash.
+ * @return	The base address of the sector, the end of the flash past the last sector.
+ */
+uint32_t Flash_GetSectorAddress(uint8_t sector)
+{
+	return sector_addresses[(sector < FLASH_TOTAL_SECTORS) ? sector : FLASH_TOTAL_SECTORS];
+}
+
+/**
+ * @brief	This function checks that a flash area is fully erased (all bytes 0xFF).
+ * 			Words are tested eight at a time, a programmed area usually fails on the first block.
+ * @param 	address: The start address of the area, word aligned.
+ * @param 	size: The size of the area in words (each word is 4 bytes).
+ * @return	True if every word of the area reads 0xFFFFFFFF, false otherwise.
+ */
+bool Flash_IsBlank(uint32_t address, uint32_t size)
+{
+	const volatile uint32_t *word = (const volatile uint32_t *)address;
+	uint32_t i = 0;
+
+	for(; (i + 8) <= size; i += 8)
+	{
+		if((word[i] & word[i + 1] & word[i + 2] & word[i + 3] &
+			word[i + 4] & word[i + 5] & word[i + 6] & word[i + 7]) != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+
+	for(; i < size; i++)
+	{
+		if(word[i] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief	This function checks that a flash sector is fully erased.
+ * @param 	sector: The sector number to be checked.
+ * @return	True if the sector is blank, false otherwise.
+ */
+bool Flash_IsSectorBlank(uint8_t sector)
+{
+	if(sector >= FLASH_TOTAL_SECTORS)
+	{
+		return false;
+	}
+
+	return Flash_IsBlank(sector_addresses[sector], (sector_addresses[sector + 1] - sector_addresses[sector]) / 4);
+}
+
 
 /**
  * @brief	This function writes data to the specified address in flash memory.
@@ -91,7 +261,10 @@ uint8_t Flash_Write_Word(uint32_t address, uint32_t *data, uint32_t size)
 {
 	uint8_t flash_status = FLASH_OK;
 
-	HAL_FLASH_Unlock();
+	if (flash_open == false)
+	{
+		HAL_FLASH_Unlock();
+	}
 
     // Check if the write operation exceeds the flash memory boundary
     if ((address < APP_BASE_ADDRESS) ||
@@ -124,11 +297,90 @@ uint8_t Flash_Write_Word(uint32_t address, uint32_t *data, uint32_t size)
         }
     }
 
-    HAL_FLASH_Lock();
+    if (flash_open == false)
+    {
+    	HAL_FLASH_Lock();
+    }
 
     return flash_status;
 }
 
+/**
+ * @brief	This function programs a block of words through the flash registers.
+ * 			Unlike Flash_Write_Word, it needs a session opened by Flash_Open: the flash stays
+ * 			unlocked and the parallelism configured, the words are streamed with a single busy
+ * 			flag poll each, and the error flags are checked once at the end of the block. The
+ * 			data is not read back, the caller verifies the block with the policy it needs.
+ * 			It runs from RAM (__RAM_FUNC): fetched from flash, its loop would stall behind every word programmed.
+ * @param	address: The address in flash memory where the data will be written.
+ * @param	data: Pointer to the data array to be written.
+ * @param	size: The size of the data array in words (each word is 4 bytes).
+ * @return	Flash error code ::eFlashErrorCodes
+ *         - FLASH_OK: The write operation was successful.
+ *         - FLASH_UNL_ERROR: No programming session is open.
+ *         - FLASH_WRITE_OVER_ERROR: The write operation exceeds the flash memory boundary.
+ *         - FLASH_WRITE_ERROR: The write operation failed.
+ */
+__RAM_FUNC uint8_t Flash_Program_Burst(uint32_t address, const uint32_t *data, uint32_t size)
+{
+	volatile uint32_t *destination = (volatile uint32_t *)address;
+	uint32_t errors;
+
+    if ((address < APP_BASE_ADDRESS) ||
+    	((address + (size * 4)) > (APP_END_ADDRESS)) ||
+	    ((address % 4) != 0))
+    {
+        return FLASH_WRITE_OVER_ERROR;
+    }
+
+    if ((flash_open == false) || (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0))
+    {
+    	return FLASH_UNL_ERROR;
+    }
+
+    SET_BIT(FLASH->CR, FLASH_CR_PG);
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+    	destination[i] = data[i];
+
+    	while (READ_BIT(FLASH->SR, FLASH_SR_BSY) != 0);
+    }
+
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+
+    // Report the errors of the whole block
+    errors = FLASH->SR & (FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+    if (errors != 0)
+    {
+    	__HAL_FLASH_CLEAR_FLAG(errors);
+    	return FLASH_WRITE_ERROR;
+    }
+
+    return FLASH_OK;
+}
+
+/**
+ * @brief	This function checks that an area can be read by Flash_Read_Word: word aligned, in the flash memory.
+ * @param	address: The start address of the area.
+ * @param	size: The size of the area (in words, each word is 4 bytes).
+ * @return	Flasg error code ::eFlashErrorCodes
+ * 			- FLASH_OK: The area can be read.
+ * 			- FLASH_READ_OVER_ERROR: The area exceeds the flash memory boundaries.
+ */
+uint8_t Flash_CheckRead(uint32_t address, uint32_t size)
+{
+    if ((address < FLASH_BASE_ADDRESS) || (address > (FLASH_BASE_ADDRESS + FLASH_SIZE)) ||
+        (size > ((FLASH_BASE_ADDRESS + FLASH_SIZE - address) / 4)) ||
+		((address % 4) != 0))
+    {
+    	return FLASH_READ_OVER_ERROR;
+    }
+
+    return FLASH_OK;
+}
+
 /**
  * @brief	This function reads data from the flash memory.
  * @param	address: The start address of the flash memory to read from.
@@ -140,15 +392,9 @@ uint8_t Flash_Write_Word(uint32_t address, uint32_t *data, uint32_t size)
  */
 uint8_t Flash_Read_Word(uint32_t address, uint32_t *data, uint32_t size)
 {
-	uint8_t flash_status = FLASH_OK;
+	uint8_t flash_status = Flash_CheckRead(address, size);
 
-    if ((address < FLASH_BASE_ADDRESS) ||
-        ((address + (size * 4)) > (FLASH_BASE_ADDRESS + FLASH_SIZE)) ||
-		((address % 4) != 0))
-    {
-    	flash_status = FLASH_READ_OVER_ERROR;
-    }
-    else
+    if (flash_status == FLASH_OK)
     {
         for (uint32_t i = 0; i < size; i += 1)
         {
@@ -160,6 +406,28 @@ uint8_t Flash_Read_Word(uint32_t address, uint32_t *data, uint32_t size)
     return flash_status;
 }
 
+/**
+ * @brief	This function reads bytes from the flash memory, at any alignment.
+ * @param	address: The start address of the flash memory to read from.
+ * @param	data: Pointer to the buffer where the read data will be stored.
+ * @param	length: The number of bytes to read.
+ * @return	Flasg error code ::eFlashErrorCodes
+ * 			- FLASH_OK: The flash read operation was successful.
+ * 			- FLASH_READ_OVER_ERROR: The read operation exceeded the flash memory boundaries.
+ */
+uint8_t Flash_Read(uint32_t address, uint8_t *data, uint32_t length)
+{
+    if ((address < FLASH_BASE_ADDRESS) || (address > (FLASH_BASE_ADDRESS + FLASH_SIZE)) ||
+        (length > (FLASH_BASE_ADDRESS + FLASH_SIZE - address)))
+    {
+    	return FLASH_READ_OVER_ERROR;
+    }
+
+    memcpy(data, (const void *)address, length);
+
+    return FLASH_OK;
+}
+
 
 /**
  * @brief	This function verifies the checksum value stored in flash memory with the calculated checksum of the application.
@@ -173,3 +441,322 @@ uint32_t Flash_GetChecksum(uint32_t start_address, uint32_t size)
     return HAL_CRC_Calculate(&hcrc, (uint32_t *)start_address, size);
 }
 
+/**
+ * @brief	This function continues a checksum over a new area, the CRC unit may have been used in between.
+ * 			The CRC unit is reset, then fed with the word that brings its reset value to the checksum
+ * 			to resume, found by running the 32 shift steps of the CRC backwards.
+ * @param	checksum: The checksum to resume, CRC_INITIAL_VALUE to start a new one.
+ * @param	start_address: The start address of the area.
+ * @param	size: The size of the area in words (each word is 4 bytes).
+ * @return	The checksum including the area.
+ */
+uint32_t Flash_ResumeChecksum(uint32_t checksum, uint32_t start_address, uint32_t size)
+{
+	uint32_t seed = checksum;
+
+	for (uint8_t bit = 0; bit < 32; bit++)
+	{
+		seed = (seed & 1) ? (((seed ^ CRC_POLYNOMIAL) >> 1) | 0x80000000) : (seed >> 1);
+	}
+
+	__HAL_CRC_DR_RESET(&hcrc);
+	hcrc.Instance->DR = seed ^ CRC_INITIAL_VALUE;
+
+	return HAL_CRC_Accumulate(&hcrc, (uint32_t *)start_address, size);
+}
+
+/**
+ * @brief	This function starts the next DMA transfer of a DMA fed checksum.
+ * @param	None
+ * @return	None
+ */
+static void Flash_StartChecksumTransfer(void)
+{
+	uint32_t size = (crc_dma_remaining > CRC_DMA_MAX_WORDS) ? CRC_DMA_MAX_WORDS : crc_dma_remaining;
+	uint32_t address = crc_dma_address;
+
+	crc_dma_address = address + (size * 4);
+	crc_dma_remaining -= size;
+
+	if (HAL_DMA_Start_IT(&hdma_memtomem_dma2_stream0, address, (uint32_t)&hcrc.Instance->DR, size) != HAL_OK)
+	{
+		crc_dma_status = FLASH_CRC_ERROR;
+	}
+}
+
+/**
+ * @brief	DMA transfer complete callback of a DMA fed checksum, chains the next transfer.
+ * @param	hdma: The DMA handle.
+ * @return	None
+ */
+static void Flash_ChecksumTransferCplt(DMA_HandleTypeDef *hdma)
+{
+	if (crc_dma_remaining > 0)
+	{
+		Flash_StartChecksumTransfer();
+	}
+	else
+	{
+		crc_dma_status = FLASH_OK;
+		Sched_Post(SCHED_EVENT_DMA);
+	}
+}
+
+/**
+ * @brief	DMA transfer error callback of a DMA fed checksum.
+ * @param	hdma: The DMA handle.
+ * @return	None
+ */
+static void Flash_ChecksumTransferError(DMA_HandleTypeDef *hdma)
+{
+	crc_dma_remaining = 0;
+	crc_dma_status = FLASH_CRC_ERROR;
+	Sched_Post(SCHED_EVENT_DMA);
+}
+
+/**
+ * @brief	This function starts a checksum where the DMA, instead of the CPU, feeds the area to the CRC unit.
+ * 			It returns at once, Flash_GetChecksumDMA reports the completion. The CRC unit must not be used
+ * 			until the checksum is completed.
+ * @param	start_address: The start address of the area.
+ * @param	size: The size of the area in words (each word is 4 bytes).
+ * @return	Flash error code ::eFlashErrorCodes
+ *			- FLASH_CRC_BUSY: A DMA fed checksum is already running.
+ *			- FLASH_CRC_ERROR: The DMA couldn't be started.
+ *			- FLASH_OK: The checksum is running.
+ */
+uint8_t Flash_StartChecksumDMA(uint32_t start_address, uint32_t size)
+{
+	if (crc_dma_status == FLASH_CRC_BUSY)
+	{
+		return FLASH_CRC_BUSY;
+	}
+
+	__HAL_CRC_DR_RESET(&hcrc);
+
+	if (size == 0)
+	{
+		crc_dma_status = FLASH_OK;
+		return FLASH_OK;
+	}
+
+	HAL_DMA_RegisterCallback(&hdma_memtomem_dma2_stream0, HAL_DMA_XFER_CPLT_CB_ID, Flash_ChecksumTransferCplt);
+	HAL_DMA_RegisterCallback(&hdma_memtomem_dma2_stream0, HAL_DMA_XFER_ERROR_CB_ID, Flash_ChecksumTransferError);
+
+	crc_dma_address = start_address;
+	crc_dma_remaining = size;
+	crc_dma_status = FLASH_CRC_BUSY;
+
+	Flash_StartChecksumTransfer();
+
+	return (crc_dma_status == FLASH_CRC_ERROR) ? FLASH_CRC_ERROR : FLASH_OK;
+}
+
+/**
+ * @brief	This function reports the state of the DMA fed checksum, without waiting.
+ * @param	checksum: Set to the checksum once it is completed.
+ * @return	Flash error code ::eFlashErrorCodes
+ *			- FLASH_CRC_BUSY: The checksum is still running.
+ *			- FLASH_CRC_ERROR: The DMA transfer failed.
+ *			- FLASH_OK: The checksum is completed.
+ */
+uint8_t Flash_GetChecksumDMA(uint32_t *checksum)
+{
+	uint8_t status = crc_dma_status;
+
+	if (status == FLASH_OK)
+	{
+		*checksum = hcrc.Instance->DR;
+	}
+
+	return status;
+}
+
+/**
+ * @brief	This function starts the job at the tail of the queue, unless a job is already running.
+ * 			Called with the flash interrupt unable to preempt it.
+ * @param	None
+ * @return	None
+ */
+static void Flash_StartJob(void)
+{
+	s_Flash_Job *job = &flash_jobs[flash_job_tail];
+	FLASH_EraseInitTypeDef eraseInit;
+
+	if (flash_job_running || (flash_job_tail == flash_job_head))
+	{
+		return;
+	}
+
+	if (READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0)
+	{
+		HAL_FLASH_Unlock();
+		flash_job_unlocked = true;
+	}
+
+	flash_job_running = true;
+	flash_job_event = false;
+	flash_job_status = FLASH_OK;
+	flash_job_start = Perf_GetCycles();
+
+	eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+	eraseInit.Sector = job->sector;
+	eraseInit.NbSectors = 1;
+	eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+	if (HAL_FLASHEx_Erase_IT(&eraseInit) != HAL_OK)
+	{
+		Flash_EndJob(FLASH_ERASE_ERROR);
+	}
+}
+
+/**
+ * @brief	This function completes the running job, reports it and starts the next one.
+ * @param	status: The e_Flash_Status of the job.
+ * @return	None
+ */
+static void Flash_EndJob(uint8_t status)
+{
+	s_Flash_Job *job = &flash_jobs[flash_job_tail];
+
+	Perf_AddCycles(PERF_FLASH_JOB_CYCLES, flash_job_start);
+	perf_counters[PERF_FLASH_JOBS]++;
+
+	flash_job_running = false;
+	flash_job_tail = (flash_job_tail + 1) % FLASH_JOB_QUEUE_SIZE;
+
+	if (job->callback != NULL)
+	{
+		job->callback(status, job->sector);
+	}
+
+	Sched_Post(SCHED_EVENT_FLASH);
+
+	if (flash_job_tail != flash_job_head)
+	{
+		Flash_StartJob();
+	}
+	else if (flash_job_unlocked && (flash_open == false))
+	{
+		flash_job_unlocked = false;
+		HAL_FLASH_Lock();
+	}
+}
+
+/**
+ * @brief	This function adds a job to the queue and starts it if the flash is idle.
+ * @param	job: The job to copy into the queue.
+ * @return	Flash error code ::eFlashErrorCodes
+ *			- FLASH_JOB_QUEUE_FULL: The queue has no room left.
+ *			- FLASH_OK: The job is queued.
+ */
+static uint8_t Flash_QueueJob(const s_Flash_Job *job)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint8_t status = FLASH_OK;
+	uint8_t next;
+
+	// Jobs may be queued from a completion callback, in the flash interrupt
+	__disable_irq();
+
+	next = (flash_job_head + 1) % FLASH_JOB_QUEUE_SIZE;
+
+	if (next == flash_job_tail)
+	{
+		status = FLASH_JOB_QUEUE_FULL;
+	}
+	else
+	{
+		flash_jobs[flash_job_head] = *job;
+		flash_job_head = next;
+		Flash_StartJob();
+	}
+
+	__set_PRIMASK(primask);
+
+	return status;
+}
+
+/**
+ * @brief	This function queues the erase of a flash sector and returns at once.
+ *
+ * 			The jobs run one after the other, each one started by the end of operation
+ * 			interrupt of the previous one. The flash is unlocked while jobs run, if no
+ * 			session opened by Flash_Open keeps it unlocked already. The blocking functions
+ * 			must not be used until Flash_IsBusy returns false.
+ *
+ * 			While an erase runs, any read of the flash stalls until it ends: as long
+ * 			as the code and the vector table are fetched from flash, the CPU and every interrupt,
+ * 			USB included, are frozen for the whole operation, up to 2 s for a 128 KB sector.
+ * 			PERF_TICK_LATENCY_MAX measures how long the interrupts were held off.
+ * @param	sector: The sector number to be erased.
+ * @param	callback: Called from the flash interrupt once the sector is erased, may be NULL.
+ * @return	Flash error code ::eFlashErrorCodes
+ *			- FLASH_JOB_QUEUE_FULL: The queue has no room left.
+ *			- FLASH_ERASE_ERROR: The sector is outside of the flash.
+ *			- FLASH_OK: The erase is queued.
+ */
+uint8_t Flash_QueueErase(uint8_t sector, pFlash_Callback callback)
+{
+	s_Flash_Job job = { .sector = sector, .callback = callback };
+
+	if (sector >= FLASH_TOTAL_SECTORS)
+	{
+		return FLASH_ERASE_ERROR;
+	}
+
+	return Flash_QueueJob(&job);
+}
+
+/**
+ * @brief	This function reports whether asynchronous jobs are running or queued.
+ * @param	None
+ * @return	True until the last queued job has completed.
+ */
+bool Flash_IsBusy(void)
+{
+	return flash_job_running || (flash_job_tail != flash_job_head);
+}
+
+/**
+ * @brief	This function steps the running job, to call from the flash interrupt once the HAL has
+ * 			handled it: the HAL can't start the next operation from its own callbacks.
+ * @param	None
+ * @return	None
+ */
+void Flash_JobIRQHandler(void)
+{
+	if ((flash_job_running == false) || (flash_job_event == false))
+	{
+		return;
+	}
+
+	flash_job_event = false;
+
+	Flash_EndJob(flash_job_status);
+}
+
+/**
+ * @brief	HAL callback of the flash interrupt: an erase has ended.
+ * @param	ReturnValue: The sector erased.
+ * @return	None
+ */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	UNUSED(ReturnValue);
+
+	flash_job_event = true;
+}
+
+/**
+ * @brief	HAL callback of the flash interrupt: the running operation has failed.
+ * @param	ReturnValue: The faulty sector.
+ * @return	None
+ */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	UNUSED(ReturnValue);
+
+	flash_job_status = FLASH_ERASE_ERROR;
+	flash_job_event = true;
+}
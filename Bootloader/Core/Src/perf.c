@@ -0,0 +1,65 @@
+
+/* Includes ---------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "perf.h"
+
+
+/* Global variables -------------------------------------------------------*/
+
+uint32_t perf_counters[PERF_COUNT];
+
+static uint32_t last_tick_cycles;				// Cycle count at the last tick interrupt
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	This function starts the DWT cycle counter used for the measurements.
+ * @param	None
+ * @return	None
+ */
+void Perf_Init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	Perf_Reset();
+}
+
+/**
+ * @brief	This function clears all the performance counters.
+ * @param	None
+ * @return	None
+ */
+void Perf_Reset(void)
+{
+	memset(perf_counters, 0, sizeof(perf_counters));
+
+	perf_counters[PERF_CORE_CLOCK_HZ] = SystemCoreClock;
+	last_tick_cycles = Perf_GetCycles();
+}
+
+/**
+ * @brief	This function measures the delay of the tick interrupt, to call from it. The ticks are
+ * 			1 ms apart: anything longer is the time the interrupts were held off, by a masked
+ * 			section or by the CPU stalled on a flash fetch during an erase or a program.
+ * @param	None
+ * @return	None
+ */
+void Perf_Tick(void)
+{
+	uint32_t now = Perf_GetCycles();
+	uint32_t period = SystemCoreClock / 1000;
+	uint32_t latency = now - last_tick_cycles;
+
+	last_tick_cycles = now;
+	latency = (latency > period) ? (latency - period) : 0;
+
+	if (latency > perf_counters[PERF_TICK_LATENCY_MAX])
+	{
+		perf_counters[PERF_TICK_LATENCY_MAX] = latency;
+	}
+}
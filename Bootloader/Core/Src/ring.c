@@ -0,0 +1,198 @@
+
+/* Includes ---------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "ring.h"
+
+
+/* Macro definitions ------------------------------------------------------*/
+
+// The data must be visible before the index that publishes it, and read after the index that announced it
+#define RING_RELEASE()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define RING_ACQUIRE()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	This function initializes an empty ring over a buffer.
+ * @param	ring: The ring.
+ * @param	buffer: The storage of the ring.
+ * @param	size: The size of the storage in bytes, a power of two.
+ * @return	None
+ */
+void Ring_Init(s_Ring *ring, uint8_t *buffer, uint32_t size)
+{
+	ring->buffer = buffer;
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/**
+ * @brief	This function returns the number of bytes held by the ring.
+ * @param	ring: The ring.
+ * @return	The number of bytes the consumer can read.
+ */
+uint32_t Ring_Used(const s_Ring *ring)
+{
+	return ring->head - ring->tail;
+}
+
+/**
+ * @brief	This function returns the free space of the ring.
+ * @param	ring: The ring.
+ * @return	The number of bytes the producer can write.
+ */
+uint32_t Ring_Free(const s_Ring *ring)
+{
+	return (ring->mask + 1) - (ring->head - ring->tail);
+}
+
+/**
+ * @brief	This function copies data into the ring, in at most two contiguous chunks.
+ * @param	ring: The ring.
+ * @param	data: The data to write.
+ * @param	length: The number of bytes to write.
+ * @return	The number of bytes written, less than length if the ring is full.
+ */
+uint32_t Ring_Write(s_Ring *ring, const uint8_t *data, uint32_t length)
+{
+	uint32_t head = ring->head;
+	uint32_t offset = head & ring->mask;
+	uint32_t available = Ring_Free(ring);
+	uint32_t first;
+
+	if (length > available)
+	{
+		length = available;
+	}
+
+	first = (ring->mask + 1) - offset;
+	first = (length < first) ? length : first;
+
+	memcpy(&ring->buffer[offset], data, first);
+	memcpy(ring->buffer, &data[first], length - first);
+
+	RING_RELEASE();
+	ring->head = head + length;
+
+	return length;
+}
+
+/**
+ * @brief	This function gives the producer direct access to the contiguous free space of the ring.
+ * @param	ring: The ring.
+ * @param	data: Set to the first free byte.
+ * @return	The number of contiguous bytes that can be written, publish them with Ring_CommitWrite.
+ */
+uint32_t Ring_PeekWrite(s_Ring *ring, uint8_t **data)
+{
+	uint32_t offset = ring->head & ring->mask;
+	uint32_t contiguous = (ring->mask + 1) - offset;
+	uint32_t available = Ring_Free(ring);
+
+	*data = &ring->buffer[offset];
+
+	return (available < contiguous) ? available : contiguous;
+}
+
+/**
+ * @brief	This function publishes bytes written in place after Ring_PeekWrite.
+ * @param	ring: The ring.
+ * @param	length: The number of bytes written.
+ * @return	None
+ */
+void Ring_CommitWrite(s_Ring *ring, uint32_t length)
+{
+	RING_RELEASE();
+	ring->head += length;
+}
+
+/**
+ * @brief	This function discards the newest data of the ring, the oldest length bytes are kept.
+ *			Producer side, call it with the consumer held off.
+ * @param	ring: The ring.
+ * @param	length: The number of bytes to keep, at most the number held.
+ * @return	None
+ */
+void Ring_Truncate(s_Ring *ring, uint32_t length)
+{
+	ring->head = ring->tail + length;
+}
+
+/**
+ * @brief	This function copies data out of the ring, in at most two contiguous chunks.
+ * @param	ring: The ring.
+ * @param	data: The buffer receiving the data.
+ * @param	length: The number of bytes to read.
+ * @return	The number of bytes read, less than length if the ring holds less.
+ */
+uint32_t Ring_Read(s_Ring *ring, uint8_t *data, uint32_t length)
+{
+	uint32_t tail = ring->tail;
+	uint32_t offset = tail & ring->mask;
+	uint32_t available = Ring_Used(ring);
+	uint32_t first;
+
+	if (length > available)
+	{
+		length = available;
+	}
+
+	RING_ACQUIRE();
+
+	first = (ring->mask + 1) - offset;
+	first = (length < first) ? length : first;
+
+	memcpy(data, &ring->buffer[offset], first);
+	memcpy(&data[first], ring->buffer, length - first);
+
+	RING_RELEASE();
+	ring->tail = tail + length;
+
+	return length;
+}
+
+/**
+ * @brief	This function gives the consumer direct access to the contiguous data of the ring.
+ * @param	ring: The ring.
+ * @param	data: Set to the first byte to read.
+ * @return	The number of contiguous bytes that can be read, release them with Ring_CommitRead.
+ */
+uint32_t Ring_PeekRead(s_Ring *ring, const uint8_t **data)
+{
+	uint32_t offset = ring->tail & ring->mask;
+	uint32_t contiguous = (ring->mask + 1) - offset;
+	uint32_t available = Ring_Used(ring);
+
+	RING_ACQUIRE();
+
+	*data = &ring->buffer[offset];
+
+	return (available < contiguous) ? available : contiguous;
+}
+
+/**
+ * @brief	This function releases bytes read in place after Ring_PeekRead.
+ * @param	ring: The ring.
+ * @param	length: The number of bytes read.
+ * @return	None
+ */
+void Ring_CommitRead(s_Ring *ring, uint32_t length)
+{
+	RING_RELEASE();
+	ring->tail += length;
+}
+
+/**
+ * @brief	This function discards everything the ring holds. Consumer side.
+ * @param	ring: The ring.
+ * @return	None
+ */
+void Ring_Flush(s_Ring *ring)
+{
+	RING_RELEASE();
+	ring->tail = ring->head;
+}
@@ -0,0 +1,136 @@
+
+/* Includes ---------------------------------------------------------------*/
+
+#include "sched.h"
+#include "perf.h"
+
+
+/* Typedef --------------------------------------------------------------*/
+
+typedef struct
+{
+	pTask run;									// Step function of the task
+	uint32_t events;							// Events waking the task
+	bool ready;									// Set while the task has more work ready
+
+} s_Sched_Task;
+
+
+/* Global variables -------------------------------------------------------*/
+
+static s_Sched_Task sched_tasks[SCHED_MAX_TASKS];
+static uint8_t sched_task_count = 0;
+static volatile uint32_t sched_events = 0;		// Events posted since the last pass, e_Sched_Event bits
+
+
+/* Static Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	This function parks the CPU in WFI until the next interrupt, unless an event is already pending.
+ * 			The interrupts are masked around the check: an event posted after it still wakes the CPU,
+ * 			and its interrupt is serviced once they are unmasked.
+ * @param	None
+ * @return	None
+ */
+static void Sched_Sleep(void)
+{
+	uint32_t cycles;
+
+	__disable_irq();
+
+	if (sched_events == 0)
+	{
+		cycles = Perf_GetCycles();
+
+		__DSB();
+		__WFI();
+
+		Perf_AddCycles(PERF_SLEEP_CYCLES, cycles);
+	}
+
+	__enable_irq();
+}
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	This function empties the task table and drops the pending events.
+ * @param	None
+ * @return	None
+ */
+void Sched_Init(void)
+{
+	sched_task_count = 0;
+	sched_events = 0;
+}
+
+/**
+ * @brief	This function adds a task to the table. Tasks are stepped in the order they were added,
+ * 			a new task is ready and runs its first step in the next pass.
+ * @param	task: The step function of the task.
+ * @param	events: The events waking the task, e_Sched_Event bits.
+ * @return	False if the task table is full.
+ */
+bool Sched_AddTask(pTask task, uint32_t events)
+{
+	if (sched_task_count >= SCHED_MAX_TASKS)
+	{
+		return false;
+	}
+
+	sched_tasks[sched_task_count].run = task;
+	sched_tasks[sched_task_count].events = events;
+	sched_tasks[sched_task_count].ready = true;
+	sched_task_count++;
+
+	return true;
+}
+
+/**
+ * @brief	This function posts events to the tasks. Safe to call from an interrupt.
+ * @param	events: The events to post, e_Sched_Event bits.
+ * @return	None
+ */
+void Sched_Post(uint32_t events)
+{
+	__atomic_fetch_or(&sched_events, events, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief	This function runs the tasks forever. Each pass steps every task that is ready or
+ * 			has one of its events pending, so the tasks progress concurrently, each one a step
+ * 			at a time. The CPU sleeps when no task is ready until an interrupt posts an event.
+ * @param	None
+ * @return	None
+ */
+void Sched_Run(void)
+{
+	uint32_t events;
+	bool ready;
+	s_Sched_Task *task;
+
+	while (1)
+	{
+		events = __atomic_exchange_n(&sched_events, 0, __ATOMIC_ACQUIRE);
+		ready = false;
+
+		for (uint8_t i = 0; i < sched_task_count; i++)
+		{
+			task = &sched_tasks[i];
+
+			if (task->ready || ((events & task->events) != 0))
+			{
+				task->ready = task->run();
+				perf_counters[PERF_TASK_STEPS]++;
+			}
+
+			ready |= task->ready;
+		}
+
+		if (ready == false)
+		{
+			Sched_Sleep();
+		}
+	}
+}
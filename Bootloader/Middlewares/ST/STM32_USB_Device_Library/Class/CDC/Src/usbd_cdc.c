@@ -861,6 +861,34 @@ uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef *pdev)
 
   return (uint8_t)USBD_OK;
 }
+
+/**
+  * @brief  USBD_CDC_ReceiveTransfer
+  *         prepare OUT Endpoint for the reception of several packets, the transfer
+  *         completes once length bytes are received or on a short packet
+  * @param  pdev: device instance
+  * @param  length: transfer size, a multiple of the endpoint packet size
+  * @retval status
+  */
+uint8_t USBD_CDC_ReceiveTransfer(USBD_HandleTypeDef *pdev, uint32_t length)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCmsit[pdev->classId];
+
+#ifdef USE_USBD_COMPOSITE
+  /* Get the Endpoints addresses allocated for this class instance */
+  CDCOutEpAdd = USBD_CoreGetEPAdd(pdev, USBD_EP_OUT, USBD_EP_TYPE_BULK);
+#endif /* USE_USBD_COMPOSITE */
+
+  if (pdev->pClassDataCmsit[pdev->classId] == NULL)
+  {
+    return (uint8_t)USBD_FAIL;
+  }
+
+  /* Prepare Out endpoint to receive the next packets */
+  (void)USBD_LL_PrepareReceive(pdev, CDCOutEpAdd, hcdc->RxBuffer, length);
+
+  return (uint8_t)USBD_OK;
+}
 /**
   * @}
   */
@@ -0,0 +1,41 @@
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+
+/* Includes --------------------------------------------------------------*/
+
+#include <stdint.h>
+
+
+/* Typedef --------------------------------------------------------------*/
+
+/**
+ * @brief  The cycle counter of the DWT, the only register the host builds read.
+ */
+typedef struct
+{
+	volatile uint32_t CYCCNT;
+
+} s_Sim_DWT;
+
+
+/* Variables -----------------------------------------------------------------*/
+
+extern s_Sim_DWT sim_dwt;
+
+#define DWT						(&sim_dwt)
+
+
+/* Functions -----------------------------------------------------------------*/
+
+/*
+ * The core intrinsics, simulated by the test: masking the interrupts holds off the simulated
+ * interrupt requests until they are unmasked, and WFI returns when one of them is pending.
+ */
+void __disable_irq(void);
+void __enable_irq(void);
+void __DSB(void);
+void __WFI(void);
+
+
+#endif /* __STM32F4xx_HAL_H */
@@ -0,0 +1,381 @@
+
+/* Includes ---------------------------------------------------------------*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring.h"
+
+
+/* Macro definitions ------------------------------------------------------*/
+
+#define RING_SIZE				8192							// Size of the CDC receive ring
+#define STRESS_BYTES			(16UL * 1024 * 1024)			// Bytes pushed through the ring by the stress test
+#define BENCH_BYTES				(64UL * 1024 * 1024)			// Bytes copied by each micro-benchmark
+#define INDEX_NEAR_WRAP			0xFFFFF000U						// Start index of the runs crossing the 32-bit wrap of the indexes
+
+#define CHECK(condition)		do { if(!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while(0)
+
+
+/* Typedef --------------------------------------------------------------*/
+
+typedef struct
+{
+	s_Ring *ring;
+	uint32_t total;												// Bytes to transfer
+	uint32_t seed;												// Seed of the chunk sizes
+	uint32_t max_chunk;											// Largest chunk written or read at once
+	int in_place;												// Use the Peek/Commit calls instead of the copies
+	uint32_t errors;											// Bytes read out of sequence, consumer only
+
+} s_Stress_Side;
+
+
+/* Global variables -------------------------------------------------------*/
+
+static uint8_t ring_buffer[RING_SIZE];
+static int failures = 0;
+
+
+/* Static Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	Byte expected at a position of the stream, a period prime to the ring size so a
+ * 			stale or duplicated chunk never reads as the expected one.
+ * @param	position: The position in the stream.
+ * @return	The byte.
+ */
+static uint8_t StreamByte(uint32_t position)
+{
+	return (uint8_t)(position % 251);
+}
+
+/**
+ * @brief	Next chunk size, xorshift so both sides draw their own sequence.
+ * @param	seed: The state of the generator, updated.
+ * @param	max_chunk: The largest chunk size.
+ * @return	A chunk size from 1 to max_chunk.
+ */
+static uint32_t NextChunk(uint32_t *seed, uint32_t max_chunk)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	return (*seed % max_chunk) + 1;
+}
+
+/**
+ * @brief	Initializes the ring with its indexes at a chosen start, to cross the wrap of the 32-bit indexes.
+ * @param	ring: The ring.
+ * @param	start: The start value of both indexes.
+ * @return	None
+ */
+static void InitRingAt(s_Ring *ring, uint32_t start)
+{
+	Ring_Init(ring, ring_buffer, sizeof(ring_buffer));
+	ring->head = start;
+	ring->tail = start;
+}
+
+/**
+ * @brief	Producer thread of the stress test: writes the stream in random chunks, spinning while the ring is full.
+ * @param	arg: The s_Stress_Side of the producer.
+ * @return	NULL
+ */
+static void *Producer(void *arg)
+{
+	s_Stress_Side *side = arg;
+	uint8_t chunk[RING_SIZE];
+	uint8_t *room;
+	uint32_t position = 0;
+	uint32_t length;
+
+	while(position < side->total)
+	{
+		length = NextChunk(&side->seed, side->max_chunk);
+		length = (length > (side->total - position)) ? (side->total - position) : length;
+
+		if(side->in_place)
+		{
+			length = (length > Ring_PeekWrite(side->ring, &room)) ? Ring_PeekWrite(side->ring, &room) : length;
+
+			for(uint32_t i = 0; i < length; i++)
+			{
+				room[i] = StreamByte(position + i);
+			}
+
+			Ring_CommitWrite(side->ring, length);
+		}
+		else
+		{
+			for(uint32_t i = 0; i < length; i++)
+			{
+				chunk[i] = StreamByte(position + i);
+			}
+
+			length = Ring_Write(side->ring, chunk, length);
+		}
+
+		position += length;
+
+		if(length == 0)
+		{
+			sched_yield();										// Let the other side run when the host has a single core
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Consumer thread of the stress test: reads the stream in random chunks and checks every byte.
+ * @param	arg: The s_Stress_Side of the consumer.
+ * @return	NULL
+ */
+static void *Consumer(void *arg)
+{
+	s_Stress_Side *side = arg;
+	uint8_t chunk[RING_SIZE];
+	const uint8_t *data;
+	uint32_t position = 0;
+	uint32_t length;
+
+	while(position < side->total)
+	{
+		length = NextChunk(&side->seed, side->max_chunk);
+
+		if(side->in_place)
+		{
+			length = (length > Ring_PeekRead(side->ring, &data)) ? Ring_PeekRead(side->ring, &data) : length;
+		}
+		else
+		{
+			length = Ring_Read(side->ring, chunk, length);
+			data = chunk;
+		}
+
+		for(uint32_t i = 0; i < length; i++)
+		{
+			side->errors += (data[i] != StreamByte(position + i));
+		}
+
+		if(side->in_place)
+		{
+			Ring_CommitRead(side->ring, length);
+		}
+
+		position += length;
+
+		if(length == 0)
+		{
+			sched_yield();										// Let the other side run when the host has a single core
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Runs a producer and a consumer thread through the ring, the USB interrupt and the bootloader on the target.
+ * @param	in_place: Use the Peek/Commit calls on both sides.
+ * @param	max_chunk: The largest chunk of each side.
+ * @return	None
+ */
+static void TestStress(int in_place, uint32_t max_chunk)
+{
+	s_Ring ring;
+	s_Stress_Side producer = { &ring, STRESS_BYTES, 0x12345678, max_chunk, in_place, 0 };
+	s_Stress_Side consumer = { &ring, STRESS_BYTES, 0x9ABCDEF0, max_chunk, in_place, 0 };
+	pthread_t threads[2];
+
+	InitRingAt(&ring, INDEX_NEAR_WRAP);
+
+	pthread_create(&threads[0], NULL, Producer, &producer);
+	pthread_create(&threads[1], NULL, Consumer, &consumer);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	CHECK(consumer.errors == 0);
+	CHECK(Ring_Used(&ring) == 0);
+	CHECK(ring.head == (uint32_t)(INDEX_NEAR_WRAP + STRESS_BYTES));
+
+	printf("stress %-8s chunks up to %4u: %lu MB, %u bytes out of sequence\n", in_place ? "in place" : "copy",
+			max_chunk, STRESS_BYTES >> 20, consumer.errors);
+}
+
+/**
+ * @brief	Full and empty boundaries, single threaded, with the indexes before and across their wrap.
+ * @param	start: The start value of the indexes.
+ * @return	None
+ */
+static void TestBoundaries(uint32_t start)
+{
+	s_Ring ring;
+	uint8_t in[RING_SIZE + 16];
+	uint8_t out[RING_SIZE + 16];
+	uint8_t *room;
+	const uint8_t *data;
+	uint32_t shift;
+
+	for(uint32_t i = 0; i < sizeof(in); i++)
+	{
+		in[i] = StreamByte(i);
+	}
+
+	// Empty: nothing to read, the whole buffer to write
+	InitRingAt(&ring, start);
+	CHECK(Ring_Used(&ring) == 0);
+	CHECK(Ring_Free(&ring) == RING_SIZE);
+	CHECK(Ring_Read(&ring, out, 1) == 0);
+	CHECK(Ring_PeekRead(&ring, &data) == 0);
+
+	// Full: a write is cut to the free space, the whole buffer is usable
+	CHECK(Ring_Write(&ring, in, RING_SIZE + 16) == RING_SIZE);
+	CHECK(Ring_Used(&ring) == RING_SIZE);
+	CHECK(Ring_Free(&ring) == 0);
+	CHECK(Ring_Write(&ring, in, 1) == 0);
+	CHECK(Ring_PeekWrite(&ring, &room) == 0);
+
+	// A read is cut to the data held, and gives it back in order
+	CHECK(Ring_Read(&ring, out, RING_SIZE + 16) == RING_SIZE);
+	CHECK(memcmp(in, out, RING_SIZE) == 0);
+	CHECK(Ring_Used(&ring) == 0);
+
+	// Wraparound: the copies split in two chunks, the peeks stop at the end of the buffer
+	InitRingAt(&ring, start);
+	shift = (RING_SIZE - 100 - start) % RING_SIZE;
+	CHECK(Ring_Write(&ring, in, shift) == shift);
+	CHECK(Ring_Read(&ring, out, shift) == shift);
+	CHECK(Ring_PeekWrite(&ring, &room) == 100);
+	CHECK(room == &ring_buffer[RING_SIZE - 100]);
+	CHECK(Ring_Write(&ring, in, 300) == 300);
+	CHECK(Ring_PeekRead(&ring, &data) == 100);
+	CHECK(Ring_Read(&ring, out, 300) == 300);
+	CHECK(memcmp(in, out, 300) == 0);
+
+	// One byte short of full, then full across the end of the buffer
+	CHECK(Ring_Write(&ring, in, RING_SIZE - 1) == RING_SIZE - 1);
+	CHECK(Ring_Free(&ring) == 1);
+	CHECK(Ring_Write(&ring, &in[RING_SIZE - 1], 2) == 1);
+	CHECK(Ring_Free(&ring) == 0);
+	CHECK(Ring_Read(&ring, out, RING_SIZE) == RING_SIZE);
+	CHECK(memcmp(in, out, RING_SIZE) == 0);
+
+	// Truncate keeps the oldest bytes, flush drops everything
+	CHECK(Ring_Write(&ring, in, 500) == 500);
+	Ring_Truncate(&ring, 200);
+	CHECK(Ring_Used(&ring) == 200);
+	CHECK(Ring_Read(&ring, out, 500) == 200);
+	CHECK(memcmp(in, out, 200) == 0);
+	CHECK(Ring_Write(&ring, in, 500) == 500);
+	Ring_Flush(&ring);
+	CHECK(Ring_Used(&ring) == 0);
+	CHECK(Ring_Free(&ring) == RING_SIZE);
+}
+
+/**
+ * @brief	Seconds elapsed on the monotonic clock.
+ * @param	None
+ * @return	The time in seconds.
+ */
+static double Now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + (now.tv_nsec * 1e-9);
+}
+
+/**
+ * @brief	Micro-benchmark of a write then read of the same chunk, single threaded: the cost of the calls and the copies.
+ * @param	chunk: The chunk size.
+ * @return	None
+ */
+static void BenchCopy(uint32_t chunk)
+{
+	s_Ring ring;
+	static uint8_t in[RING_SIZE];
+	static uint8_t out[RING_SIZE];
+	uint64_t bytes = 0;
+	double start;
+
+	InitRingAt(&ring, 0);
+	start = Now();
+
+	while(bytes < BENCH_BYTES)
+	{
+		Ring_Write(&ring, in, chunk);
+		bytes += Ring_Read(&ring, out, chunk);
+	}
+
+	printf("bench copy     chunk %5u: %8.1f MB/s, %6.1f ns per write and read\n", chunk,
+			bytes / (Now() - start) / 1e6, (Now() - start) * 1e9 / (bytes / chunk));
+}
+
+/**
+ * @brief	Micro-benchmark of the threaded transfer through the ring.
+ * @param	in_place: Use the Peek/Commit calls on both sides.
+ * @param	max_chunk: The largest chunk of each side.
+ * @return	None
+ */
+static void BenchThreads(int in_place, uint32_t max_chunk)
+{
+	s_Ring ring;
+	s_Stress_Side producer = { &ring, BENCH_BYTES, 0x12345678, max_chunk, in_place, 0 };
+	s_Stress_Side consumer = { &ring, BENCH_BYTES, 0x9ABCDEF0, max_chunk, in_place, 0 };
+	pthread_t threads[2];
+	double start;
+
+	InitRingAt(&ring, 0);
+	start = Now();
+
+	pthread_create(&threads[0], NULL, Producer, &producer);
+	pthread_create(&threads[1], NULL, Consumer, &consumer);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	printf("bench threads  %-8s chunks up to %4u: %8.1f MB/s\n", in_place ? "in place" : "copy", max_chunk,
+			BENCH_BYTES / (Now() - start) / 1e6);
+}
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	Runs the ring tests, then the micro-benchmarks with --bench.
+ * @return	0 if every check passed.
+ */
+int main(int argc, char *argv[])
+{
+	TestBoundaries(0);
+	TestBoundaries(INDEX_NEAR_WRAP);
+	TestBoundaries(0xFFFFFFFFU - 50);
+
+	TestStress(0, 3);
+	TestStress(0, 64);
+	TestStress(0, RING_SIZE);
+	TestStress(1, 64);
+	TestStress(1, RING_SIZE);
+
+	if((argc > 1) && (strcmp(argv[1], "--bench") == 0))
+	{
+		BenchCopy(1);
+		BenchCopy(64);
+		BenchCopy(512);
+		BenchCopy(4096);
+		BenchThreads(0, 64);
+		BenchThreads(0, 4096);
+		BenchThreads(1, 64);
+		BenchThreads(1, 4096);
+	}
+
+	printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,359 @@
+
+/* Includes ---------------------------------------------------------------*/
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "perf.h"
+
+
+/* Macro definitions ------------------------------------------------------*/
+
+#define SIM_MAX_IRQS			8								// Interrupts scheduled or pending at once
+#define SIM_SLEEP_CYCLES		1000							// Cycles a WFI lasts before its interrupt fires
+#define TRACE_SIZE				64								// Task steps recorded by a test
+
+#define CHECK(condition)		do { if(!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while(0)
+#define CHECK_TRACE(expected)	do { if(strcmp(trace, expected) != 0) { printf("%s:%d: steps \"%s\", expected \"%s\"\n", __FILE__, __LINE__, trace, expected); failures++; } } while(0)
+
+
+/* Typedef --------------------------------------------------------------*/
+
+typedef void (*pIsr)(void);
+
+
+/* Global variables -------------------------------------------------------*/
+
+s_Sim_DWT sim_dwt;
+uint32_t perf_counters[PERF_COUNT];
+
+static int failures = 0;
+
+static int irq_masked;											// Set between __disable_irq and __enable_irq
+static pIsr irq_pending[SIM_MAX_IRQS];							// Interrupts raised while masked
+static uint32_t irq_pending_count;
+static pIsr irq_scheduled[SIM_MAX_IRQS];						// Interrupts fired one per WFI, in order
+static uint32_t irq_scheduled_count;
+static uint32_t irq_scheduled_next;
+static pIsr dsb_irq;											// Interrupt raised by the next __DSB, between the check and WFI
+static uint32_t wfi_count;
+static jmp_buf idle_exit;										// Target of a WFI with no interrupt left to wake it
+
+static char trace[TRACE_SIZE];									// One letter per task step, in order
+static uint32_t trace_length;
+static uint32_t steps_ready_a;									// Steps task A still returns ready
+static pIsr step_irq_b;											// Interrupt raised during the next step of task B
+
+
+/* Static Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	Raises a simulated interrupt: it runs at once, or when the interrupts are unmasked.
+ * @param	isr: The interrupt handler.
+ * @return	None
+ */
+static void Sim_RaiseIrq(pIsr isr)
+{
+	if(irq_masked)
+	{
+		irq_pending[irq_pending_count++] = isr;
+	}
+	else
+	{
+		isr();
+	}
+}
+
+/**
+ * @brief	Resets the simulated core: unmasked, nothing pending nor scheduled.
+ * @param	None
+ * @return	None
+ */
+static void Sim_Reset(void)
+{
+	irq_masked = 0;
+	irq_pending_count = 0;
+	irq_scheduled_count = 0;
+	irq_scheduled_next = 0;
+	dsb_irq = NULL;
+	wfi_count = 0;
+	sim_dwt.CYCCNT = 0;
+	memset(perf_counters, 0, sizeof(perf_counters));
+
+	trace_length = 0;
+	trace[0] = '\0';
+	steps_ready_a = 0;
+	step_irq_b = NULL;
+}
+
+/**
+ * @brief	Schedules an interrupt to wake the CPU from one of the next WFI.
+ * @param	isr: The interrupt handler.
+ * @return	None
+ */
+static void Sim_ScheduleIrq(pIsr isr)
+{
+	irq_scheduled[irq_scheduled_count++] = isr;
+}
+
+/**
+ * @brief	Runs the scheduler until the CPU would sleep with no interrupt left to wake it.
+ * @param	None
+ * @return	None
+ */
+static void Sim_RunUntilIdle(void)
+{
+	if(setjmp(idle_exit) == 0)
+	{
+		Sched_Run();
+	}
+
+	irq_masked = 0;
+}
+
+/**
+ * @brief	Records a task step.
+ * @param	letter: The letter of the task.
+ * @return	None
+ */
+static void Trace(char letter)
+{
+	if(trace_length < (TRACE_SIZE - 1))
+	{
+		trace[trace_length++] = letter;
+		trace[trace_length] = '\0';
+	}
+}
+
+static void Isr_Rx(void)		{ Sched_Post(SCHED_EVENT_RX); }
+static void Isr_Tx(void)		{ Sched_Post(SCHED_EVENT_TX); }
+static void Isr_Tick(void)		{ Sched_Post(SCHED_EVENT_TICK); }
+static void Isr_RxTick(void)	{ Sched_Post(SCHED_EVENT_RX | SCHED_EVENT_TICK); }
+static void Isr_Spurious(void)	{ }
+
+/**
+ * @brief	Task A, woken by SCHED_EVENT_RX, stays ready for steps_ready_a steps.
+ */
+static bool Task_A(void)
+{
+	Trace('A');
+
+	if(steps_ready_a > 0)
+	{
+		steps_ready_a--;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * @brief	Task B, woken by SCHED_EVENT_TX, an interrupt can be raised during its step.
+ */
+static bool Task_B(void)
+{
+	Trace('B');
+
+	if(step_irq_b != NULL)
+	{
+		pIsr isr = step_irq_b;
+
+		step_irq_b = NULL;
+		Sim_RaiseIrq(isr);
+	}
+
+	return false;
+}
+
+/**
+ * @brief	Task C, woken by SCHED_EVENT_TICK.
+ */
+static bool Task_C(void)
+{
+	Trace('C');
+
+	return false;
+}
+
+/**
+ * @brief	Adds the three tasks of the tests, in the order A, B, C.
+ * @param	None
+ * @return	None
+ */
+static void AddTasks(void)
+{
+	Sched_Init();
+	CHECK(Sched_AddTask(Task_A, SCHED_EVENT_RX));
+	CHECK(Sched_AddTask(Task_B, SCHED_EVENT_TX));
+	CHECK(Sched_AddTask(Task_C, SCHED_EVENT_TICK));
+}
+
+/**
+ * @brief	The tasks are stepped in table order, each new task once, then the CPU sleeps.
+ */
+static void TestOrder(void)
+{
+	Sim_Reset();
+	AddTasks();
+	CHECK(Sched_AddTask(Task_C, SCHED_EVENT_TICK));
+	CHECK(Sched_AddTask(Task_A, SCHED_EVENT_RX) == false);
+
+	Sim_RunUntilIdle();
+
+	CHECK_TRACE("ABCC");
+	CHECK(wfi_count == 1);
+}
+
+/**
+ * @brief	Interrupts firing during WFI wake the tasks waiting for their events, and only them, in table order.
+ */
+static void TestWakeUp(void)
+{
+	Sim_Reset();
+	AddTasks();
+	Sim_ScheduleIrq(Isr_Tx);
+	Sim_ScheduleIrq(Isr_RxTick);
+	Sim_ScheduleIrq(Isr_Spurious);
+	Sim_ScheduleIrq(Isr_Tick);
+
+	Sim_RunUntilIdle();
+
+	CHECK_TRACE("ABC" "B" "AC" "C");
+	CHECK(wfi_count == 5);
+	CHECK(perf_counters[PERF_TASK_STEPS] == 7);
+	CHECK(perf_counters[PERF_SLEEP_CYCLES] == 4 * SIM_SLEEP_CYCLES);
+}
+
+/**
+ * @brief	An event posted after the scheduler found none, before it sleeps, still wakes its task:
+ * 			the interrupt is held off until WFI, which returns at once since it is pending.
+ */
+static void TestNoLostWakeUp(void)
+{
+	Sim_Reset();
+	AddTasks();
+	dsb_irq = Isr_Rx;
+
+	Sim_RunUntilIdle();
+
+	CHECK_TRACE("ABC" "A");
+	CHECK(wfi_count == 2);
+	CHECK(perf_counters[PERF_SLEEP_CYCLES] == 0);
+}
+
+/**
+ * @brief	Events posted by an interrupt during a pass re-arm the tasks for the next pass, even the ones
+ * 			already stepped in this pass, and the CPU doesn't sleep in between.
+ */
+static void TestPostDuringStep(void)
+{
+	Sim_Reset();
+	AddTasks();
+	step_irq_b = Isr_RxTick;
+	Sim_ScheduleIrq(Isr_Tick);
+
+	Sim_RunUntilIdle();
+
+	CHECK_TRACE("ABC" "AC" "C");
+	CHECK(wfi_count == 2);
+}
+
+/**
+ * @brief	A task with more work ready is stepped again in the next passes, without sleeping,
+ * 			while the others wait for their events.
+ */
+static void TestReady(void)
+{
+	Sim_Reset();
+	AddTasks();
+	steps_ready_a = 2;
+	Sim_ScheduleIrq(Isr_Tx);
+
+	Sim_RunUntilIdle();
+
+	CHECK_TRACE("ABC" "A" "A" "B");
+	CHECK(wfi_count == 2);
+}
+
+
+/* Functions --------------------------------------------------------------*/
+
+/**
+ * @brief	Masks the simulated interrupts.
+ */
+void __disable_irq(void)
+{
+	irq_masked = 1;
+}
+
+/**
+ * @brief	Unmasks the simulated interrupts and runs the ones pending, in the order they were raised.
+ */
+void __enable_irq(void)
+{
+	irq_masked = 0;
+
+	for(uint32_t i = 0; i < irq_pending_count; i++)
+	{
+		irq_pending[i]();
+	}
+
+	irq_pending_count = 0;
+}
+
+/**
+ * @brief	The barrier before WFI, raises the interrupt a test placed between the check and the sleep.
+ */
+void __DSB(void)
+{
+	if(dsb_irq != NULL)
+	{
+		pIsr isr = dsb_irq;
+
+		dsb_irq = NULL;
+		Sim_RaiseIrq(isr);
+	}
+}
+
+/**
+ * @brief	Returns at once if an interrupt is pending, else sleeps until the next scheduled one fires.
+ * 			With none left the CPU would sleep forever, the test leaves Sched_Run.
+ */
+void __WFI(void)
+{
+	wfi_count++;
+
+	if(irq_pending_count > 0)
+	{
+		return;
+	}
+
+	if(irq_scheduled_next < irq_scheduled_count)
+	{
+		sim_dwt.CYCCNT += SIM_SLEEP_CYCLES;
+		Sim_RaiseIrq(irq_scheduled[irq_scheduled_next++]);
+		return;
+	}
+
+	longjmp(idle_exit, 1);
+}
+
+/**
+ * @brief	Runs the scheduler tests against the simulated core.
+ * @return	0 if every check passed.
+ */
+int main(void)
+{
+	TestOrder();
+	TestWakeUp();
+	TestNoLostWakeUp();
+	TestPostDuringStep();
+	TestReady();
+
+	printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "perf.h"
+#include "ring.h"
+#include "sched.h"
+
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -68,6 +72,11 @@
   */
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+
+#define RX_PACKET_SIZE		CDC_DATA_FS_OUT_PACKET_SIZE		// Room the ring must have before the OUT endpoint is armed
+#define RX_BLOCK_MASK		(RX_BLOCKS - 1)
+#define TX_ROOM_TIMEOUT		(uint32_t)100					// Time a message waits for room in the transmit queue, in ms
+
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -81,8 +90,6 @@
 
 /* USER CODE BEGIN PRIVATE_MACRO */
 
-#define RX_BUFFER_SIZE		(uint16_t)1024
-
 /* USER CODE END PRIVATE_MACRO */
 
 /**
@@ -105,9 +112,33 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 uint8_t linecoding_cfg[7] = {0};
 
-volatile uint8_t rxBuffer[RX_BUFFER_SIZE]; 		// Receive buffer
-volatile uint16_t rxBufferHeadPos = 0; 			// Receive buffer write position
-volatile uint16_t rxBufferTailPos = 0; 			// Receive buffer read position
+_Static_assert((RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) == 0, "RX_BUFFER_SIZE must be a power of two");
+
+uint8_t rxBuffer[RX_BUFFER_SIZE]; 				// Receive buffer
+s_Ring rxRing = { rxBuffer, RX_BUFFER_SIZE - 1, 0, 0 };	// Receive ring, filled by CDC_Receive_FS and emptied by the bootloader
+
+volatile uint8_t rxStalled = 0;					// Set while the OUT endpoint is left disarmed because the ring is nearly full
+uint32_t rxStallStart = 0;						// Cycle count when the OUT endpoint was left disarmed
+
+_Static_assert((RX_BLOCKS & (RX_BLOCKS - 1)) == 0, "RX_BLOCKS must be a power of two");
+
+// Block mode: the OUT endpoint receives in place into the blocks queued by the bootloader, in queue order
+volatile uint8_t rxBlockMode = 0;				// Set while the received data go to the blocks instead of the ring
+uint8_t *rxBlocks[RX_BLOCKS];					// Blocks queued by the bootloader
+volatile uint16_t rxBlockLength[RX_BLOCKS];		// Bytes received in each completed block
+volatile uint8_t rxBlockHead = 0;				// Free running index of the next block to queue, written by the bootloader only
+volatile uint8_t rxBlockFill = 0;				// Free running index of the block being filled, written by CDC_Receive_FS only
+volatile uint8_t rxBlockTail = 0;				// Free running index of the next completed block, written by the bootloader only
+volatile uint16_t rxBlockCount = 0;				// Bytes received in the block being filled
+uint16_t rxBlockSize = 0;						// Size of the blocks, a multiple of the packet size
+
+_Static_assert((APP_TX_DATA_SIZE & (APP_TX_DATA_SIZE - 1)) == 0, "APP_TX_DATA_SIZE must be a power of two");
+
+s_Ring txRing = { UserTxBufferFS, APP_TX_DATA_SIZE - 1, 0, 0 };	// Transmit queue, filled by CDC_Transmit_FS and drained by the IN transfers
+uint32_t txInFlight = 0;						// Bytes of the transmit queue sent by the IN transfer in progress
+
+uint16_t rxTransferSize = RX_PACKET_SIZE;		// Largest OUT transfer to arm, a multiple of the packet size
+uint32_t rxArmedSize = RX_PACKET_SIZE;			// Size of the OUT transfer armed, a shorter transfer ended on a short packet
 
 
 /* USER CODE END PRIVATE_VARIABLES */
@@ -144,6 +175,11 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 
+static uint8_t *CDC_GetRxDestination_FS(uint32_t *Size);
+static void CDC_CompleteRxBlock_FS(void);
+static void CDC_StartTx_FS(void);
+static void CDC_ResumeRx_FS(void);
+
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
 /**
@@ -289,24 +325,71 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
 
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, Buf);
+  uint32_t cycles = Perf_GetCycles();
+  uint32_t len = *Len;						// Get length, a transfer may hold several packets
+  uint32_t length;
+  uint8_t ended = (len < rxArmedSize);		// The transfer ended on a short packet, so did the host message
+  uint8_t *destination;
+
+  perf_counters[PERF_RX_TRANSFERS]++;
+
+  while (rxBlockMode && (rxBlockFill != rxBlockHead) && (len > 0))
+  {
+	  destination = &rxBlocks[rxBlockFill & RX_BLOCK_MASK][rxBlockCount];
+	  length = rxBlockSize - rxBlockCount;
+	  length = (len < length) ? len : length;
+
+	  // Only a transfer armed before the block mode started, or before a flush, lands elsewhere
+	  if (Buf != destination)
+	  {
+		  memmove(destination, Buf, length);
+	  }
+
+	  Buf += length;
+	  len -= length;
+	  rxBlockCount += length;
+
+	  if (rxBlockCount >= rxBlockSize)
+	  {
+		  CDC_CompleteRxBlock_FS();
+	  }
+  }
 
-  uint8_t len = (uint8_t) *Len;				// Get length
-  uint16_t tempHeadPos = rxBufferHeadPos;	// Increment temp head pos while writing, then update main variable when complete
+  // A block also ends early on the short packet that ends the host message
+  if (rxBlockMode && ended && (rxBlockCount > 0))
+  {
+	  CDC_CompleteRxBlock_FS();
+  }
 
-  for (uint32_t i = 0; i < len; i++)
+  if (len > 0)
   {
-	  rxBuffer[tempHeadPos] = Buf[i];
-	  tempHeadPos = (uint16_t)((uint16_t)(tempHeadPos + 1) % RX_BUFFER_SIZE);
+	  Ring_Write(&rxRing, Buf, len);			// The endpoint is only armed with room for the whole transfer
 
-	  if (tempHeadPos == rxBufferTailPos)
+	  if (Ring_Used(&rxRing) > perf_counters[PERF_RX_HIGH_WATER])
 	  {
-		  return USBD_FAIL; 				// Full buffer
+		  perf_counters[PERF_RX_HIGH_WATER] = Ring_Used(&rxRing);
 	  }
   }
 
-  rxBufferHeadPos = tempHeadPos;
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  destination = CDC_GetRxDestination_FS(&length);
+
+  if (destination != NULL)
+  {
+	  rxArmedSize = length;
+	  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, destination);
+	  USBD_CDC_ReceiveTransfer(&hUsbDeviceFS, length);
+  }
+  else
+  {
+	  // Leave the endpoint disarmed, the host is NAKed until the bootloader frees some room
+	  rxStallStart = Perf_GetCycles();
+	  rxStalled = 1;
+	  perf_counters[PERF_RX_STALLS]++;
+  }
+
+  Sched_Post(SCHED_EVENT_RX);
+
+  Perf_AddCycles(PERF_RX_ISR_CYCLES, cycles);
 
   return (USBD_OK);
   /* USER CODE END 6 */
@@ -317,8 +400,10 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
   *         Data to send over USB IN endpoint are sent over CDC interface
   *         through this function.
   *         @note
-  *
-  *
+  *         The data are copied into the transmit queue, the buffer can be reused on return.
+  *         Messages queued while an IN transfer is in progress are sent together by the next one.
+  *         A message never leaves in part: without room it waits for the IN transfers to drain
+  *         the queue, up to TX_ROOM_TIMEOUT, then it is dropped since the host stopped reading.
   * @param  Buf: Buffer of data to be sent
   * @param  Len: Number of data to be sent (in bytes)
   * @retval USBD_OK if all operations are OK else USBD_FAIL or USBD_BUSY
@@ -328,13 +413,22 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 7 */
 
-  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
-  if (hcdc->TxState != 0){
+  uint32_t start = HAL_GetTick();
+
+  while ((Ring_Free(&txRing) < Len) && ((HAL_GetTick() - start) < TX_ROOM_TIMEOUT));
+
+  if (Ring_Free(&txRing) < Len)
+  {
+    perf_counters[PERF_TX_DROPPED]++;
     return USBD_BUSY;
   }
 
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, Buf, Len);
-  result = USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+  Ring_Write(&txRing, Buf, Len);
+  perf_counters[PERF_TX_MESSAGES]++;
+
+  HAL_NVIC_DisableIRQ(OTG_FS_IRQn);			// The queue is also drained from the USB interrupt
+  CDC_StartTx_FS();
+  HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
 
   /* USER CODE END 7 */
   return result;
@@ -359,6 +453,19 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
   UNUSED(Buf);
   UNUSED(Len);
   UNUSED(epnum);
+
+  // Release the bytes sent and send what was queued meanwhile
+  Ring_CommitRead(&txRing, txInFlight);
+  txInFlight = 0;
+  CDC_StartTx_FS();
+
+  if (txInFlight == 0)
+  {
+    perf_counters[PERF_TX_IDLE]++;
+  }
+
+  Sched_Post(SCHED_EVENT_TX);
+
   /* USER CODE END 13 */
   return result;
 }
@@ -370,12 +477,24 @@ uint8_t CDC_ReadRxBuffer_FS(uint8_t* Buf, uint16_t Len, uint32_t timeout)
 {
 	uint16_t bytesAvailable = 0;
 	uint32_t prev_time = HAL_GetTick();
+	uint32_t cycles;
 
-	do
+	// Sleep until the next interrupt instead of spinning on the tick, a packet or the tick wakes the CPU.
+	// The interrupts are masked around the check so an interrupt raised after it still ends the WFI.
+	__disable_irq();
+
+	while(((bytesAvailable = CDC_GetRxBufferBytesAvailable_FS()) < Len) && ((HAL_GetTick() - prev_time) < timeout))
 	{
-		bytesAvailable = CDC_GetRxBufferBytesAvailable_FS();
+		cycles = Perf_GetCycles();
+		__DSB();
+		__WFI();
+		Perf_AddCycles(PERF_SLEEP_CYCLES, cycles);
 
-	} while((bytesAvailable < Len) && ((HAL_GetTick() - prev_time) < timeout));
+		__enable_irq();
+		__disable_irq();
+	}
+
+	__enable_irq();
 
 	if (bytesAvailable < Len)
 	{
@@ -383,33 +502,321 @@ uint8_t CDC_ReadRxBuffer_FS(uint8_t* Buf, uint16_t Len, uint32_t timeout)
 		return USBD_FAIL;
 	}
 
-	for (uint16_t i = 0; i < Len; i++)
+	cycles = Perf_GetCycles();
+
+	Ring_Read(&rxRing, Buf, Len);
+
+	Perf_AddCycles(PERF_RING_COPY_CYCLES, cycles);
+	perf_counters[PERF_RING_COPY_BYTES] += Len;
+
+	CDC_ResumeRx_FS();
+
+	return USBD_OK;
+}
+
+
+uint16_t CDC_GetRxBufferBytesAvailable_FS(void)
+{
+	return (uint16_t)Ring_Used(&rxRing);
+}
+
+
+uint16_t CDC_PeekRxBuffer_FS(const uint8_t **Buf)
+{
+	return (uint16_t)Ring_PeekRead(&rxRing, Buf);
+}
+
+
+void CDC_CommitRxBuffer_FS(uint16_t Len)
+{
+	Ring_CommitRead(&rxRing, Len);
+	CDC_ResumeRx_FS();
+}
+
+
+void CDC_FlushRxBuffer_FS(void)
+{
+	HAL_NVIC_DisableIRQ(OTG_FS_IRQn);			// rxBlockCount is also advanced from the USB interrupt
+
+	rxBlockCount = 0;							// In block mode the next packet starts a new block
+	Ring_Flush(&rxRing);
+
+	HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+
+	CDC_ResumeRx_FS();
+}
+
+/**
+  * @brief  Start the block mode: the following packets are received in place into the blocks
+  *         queued with CDC_QueueRxBlock_FS, one block after the other, instead of the ring.
+  *         Call it while the host waits for a reply, so that no packet is on its way.
+  * @param  BlockSize: Size of the blocks, a multiple of the packet size.
+  * @retval None
+  */
+void CDC_StartRxBlocks_FS(uint16_t BlockSize)
+{
+	HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+
+	rxBlockSize = BlockSize;
+	rxBlockCount = 0;
+	rxBlockHead = 0;
+	rxBlockFill = 0;
+	rxBlockTail = 0;
+	rxBlockMode = 1;
+
+	HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+}
+
+/**
+  * @brief  Stop the block mode, the received data go to the ring again.
+  *         The blocks still queued or not yet taken are forgotten.
+  * @retval None
+  */
+void CDC_StopRxBlocks_FS(void)
+{
+	HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+
+	rxBlockMode = 0;
+	rxBlockCount = 0;
+	rxBlockHead = rxBlockTail = rxBlockFill;
+
+	HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+
+	CDC_ResumeRx_FS();
+}
+
+/**
+  * @brief  Queue an empty block to receive into, in block mode.
+  * @param  Buf: The block, of the size given to CDC_StartRxBlocks_FS.
+  * @retval USBD_OK if queued, USBD_FAIL if RX_BLOCKS blocks are already queued
+  */
+uint8_t CDC_QueueRxBlock_FS(uint8_t *Buf)
+{
+	if ((uint8_t)(rxBlockHead - rxBlockTail) >= RX_BLOCKS)
 	{
-		Buf[i] = rxBuffer[rxBufferTailPos];
-		rxBufferTailPos = (uint16_t)((uint16_t)(rxBufferTailPos + 1) % RX_BUFFER_SIZE);
+		return USBD_FAIL;
 	}
 
+	rxBlocks[rxBlockHead & RX_BLOCK_MASK] = Buf;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rxBlockHead++;
+
+	CDC_ResumeRx_FS();
+
 	return USBD_OK;
 }
 
+/**
+  * @brief  Take the oldest block received in block mode.
+  * @param  Buf: Set to the block, in the order the blocks were queued.
+  * @retval The number of bytes received in the block, 0 if no block is complete yet
+  */
+uint16_t CDC_GetRxBlock_FS(uint8_t **Buf)
+{
+	uint16_t length;
 
-uint16_t CDC_GetRxBufferBytesAvailable_FS(void)
+	if (rxBlockTail == rxBlockFill)
+	{
+		return 0;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	*Buf = rxBlocks[rxBlockTail & RX_BLOCK_MASK];
+	length = rxBlockLength[rxBlockTail & RX_BLOCK_MASK];
+	rxBlockTail++;
+
+	return length;
+}
+
+/**
+  * @brief  Tell whether block mode data are waiting: a complete block not taken yet or a block being filled.
+  * @retval 1 if data are waiting, 0 otherwise
+  */
+uint8_t CDC_IsRxBlockPending_FS(void)
 {
-	if (rxBufferHeadPos >= rxBufferTailPos)
+	return (rxBlockTail != rxBlockFill) || (rxBlockCount > 0);
+}
+
+/**
+  * @brief  Set the largest OUT transfer armed. A transfer of several packets costs a single
+  *         callback, but it only completes once full or on a short packet: every message the
+  *         host sends meanwhile must end with a short packet.
+  * @param  Size: The transfer size, a multiple of the packet size, RX_PACKET_SIZE to receive packet by packet.
+  * @retval None
+  */
+void CDC_SetRxTransferSize_FS(uint16_t Size)
+{
+	rxTransferSize = Size;
+}
+
+/**
+  * @brief  Select where the next transfer is received: the ring through the packet buffer, or the block being filled.
+  * @param  Size: Set to the size of the transfer to arm, a multiple of the packet size.
+  * @retval The address to arm the OUT endpoint with, NULL if there is no room for a full packet
+  */
+static uint8_t *CDC_GetRxDestination_FS(uint32_t *Size)
+{
+	uint32_t room;
+
+	if (rxBlockMode)
 	{
-		return (uint16_t)(rxBufferHeadPos - rxBufferTailPos);
+		if (rxBlockFill == rxBlockHead)
+		{
+			return NULL;
+		}
+
+		room = rxBlockSize - rxBlockCount;
+		*Size = (room < rxTransferSize) ? room : rxTransferSize;
+
+		return &rxBlocks[rxBlockFill & RX_BLOCK_MASK][rxBlockCount];
 	}
 
-	return (uint16_t)(RX_BUFFER_SIZE + rxBufferHeadPos - rxBufferTailPos);
+	room = Ring_Free(&rxRing);
+	room = (room < APP_RX_DATA_SIZE) ? room : APP_RX_DATA_SIZE;
+	room = (room < rxTransferSize) ? room : rxTransferSize;
+	*Size = room - (room % RX_PACKET_SIZE);
+
+	return (*Size > 0) ? UserRxBufferFS : NULL;
+}
+
+/**
+  * @brief  Wait until the transmit queue has been sent to the host.
+  * @param  timeout: The maximum time to wait in milliseconds.
+  * @retval USBD_OK if everything was sent, USBD_BUSY on timeout
+  */
+uint8_t CDC_WaitTxDone_FS(uint32_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+
+	while ((Ring_Used(&txRing) > 0) && ((HAL_GetTick() - start) < timeout));
+
+	return (Ring_Used(&txRing) > 0) ? USBD_BUSY : USBD_OK;
 }
 
+/**
+  * @brief  Room left in the transmit queue, a message up to this size is queued whole.
+  * @retval Free bytes in the transmit queue
+  */
+uint16_t CDC_GetTxBufferFree_FS(void)
+{
+	return (uint16_t)Ring_Free(&txRing);
+}
 
-void CDC_FlushRxBuffer_FS(void)
+/**
+  * @brief  Contiguous room of the transmit queue, to be filled in place then sent with CDC_CommitTxBuffer_FS.
+  * @param  Buf: Set to the start of the room.
+  * @retval Bytes of contiguous room
+  */
+uint16_t CDC_PeekTxBuffer_FS(uint8_t **Buf)
+{
+	return (uint16_t)Ring_PeekWrite(&txRing, Buf);
+}
+
+/**
+  * @brief  Queue the bytes filled in place in the transmit queue, and send them unless a transfer is in progress.
+  * @param  Len: Bytes filled, at most the room given by CDC_PeekTxBuffer_FS.
+  * @retval None
+  */
+void CDC_CommitTxBuffer_FS(uint16_t Len)
 {
-	memset((uint8_t *)rxBuffer, 0, RX_BUFFER_SIZE);
+	Ring_CommitWrite(&txRing, Len);
+
+	HAL_NVIC_DisableIRQ(OTG_FS_IRQn);			// The queue is also drained from the USB interrupt
+	CDC_StartTx_FS();
+	HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+}
 
-	rxBufferHeadPos = 0;
-	rxBufferTailPos = 0;
+/**
+  * @brief  Drop the bytes of the transmit queue not sent yet. The transfer in progress
+  *         cannot be called back, its bytes are released when it completes.
+  * @retval None
+  */
+void CDC_FlushTxBuffer_FS(void)
+{
+	HAL_NVIC_DisableIRQ(OTG_FS_IRQn);			// The queue is also drained from the USB interrupt
+	Ring_Truncate(&txRing, txInFlight);
+	HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+}
+
+/**
+  * @brief  Start an IN transfer with the contiguous data of the transmit queue, unless one is in progress.
+  *         A transfer takes TX_TRANSFER_SIZE at most: while it is sent, the rest of the queue is filled
+  *         and sent by the next transfer as soon as the completion interrupt comes, the endpoint never idles.
+  *         Called from the USB interrupt, or with it disabled.
+  * @retval None
+  */
+static void CDC_StartTx_FS(void)
+{
+	USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+	const uint8_t *data;
+	uint32_t length;
+
+	if ((hcdc == NULL) || (hcdc->TxState != 0) || (txInFlight != 0))
+	{
+		return;
+	}
+
+	length = Ring_PeekRead(&txRing, &data);
+	length = (length > TX_TRANSFER_SIZE) ? TX_TRANSFER_SIZE : length;
+
+	if (length == 0)
+	{
+		return;
+	}
+
+	USBD_CDC_SetTxBuffer(&hUsbDeviceFS, (uint8_t *)data, length);
+
+	if (USBD_CDC_TransmitPacket(&hUsbDeviceFS) == USBD_OK)
+	{
+		txInFlight = length;
+		perf_counters[PERF_TX_TRANSFERS]++;
+		perf_counters[PERF_TX_PACKETS] += (length / CDC_DATA_FS_IN_PACKET_SIZE) + 1;		// The last packet is short, or a zero length packet
+	}
+}
+
+/**
+  * @brief  Hand the block being filled over to the bootloader, the next packets go to the next block.
+  *         Called from the USB interrupt only, thread mode resets rxBlockCount with the interrupt disabled.
+  * @retval None
+  */
+static void CDC_CompleteRxBlock_FS(void)
+{
+	rxBlockLength[rxBlockFill & RX_BLOCK_MASK] = rxBlockCount;
+	rxBlockCount = 0;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rxBlockFill++;
+}
+
+/**
+  * @brief  Re-arm the OUT endpoint left disarmed by CDC_Receive_FS once there is room for a packet.
+  *         Called by the consumer after it released data from the ring or queued a block.
+  * @retval None
+  */
+static void CDC_ResumeRx_FS(void)
+{
+	uint8_t *destination;
+	uint32_t size;
+
+	if (rxStalled)
+	{
+		HAL_NVIC_DisableIRQ(OTG_FS_IRQn);		// The endpoint is armed from thread mode, keep the USB interrupt out
+
+		destination = CDC_GetRxDestination_FS(&size);
+
+		if (rxStalled && (destination != NULL))
+		{
+			rxStalled = 0;
+			rxArmedSize = size;
+			Perf_AddCycles(PERF_RX_STALL_CYCLES, rxStallStart);
+			USBD_CDC_SetRxBuffer(&hUsbDeviceFS, destination);
+			USBD_CDC_ReceiveTransfer(&hUsbDeviceFS, size);
+		}
+
+		HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+	}
 }
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
@@ -52,6 +52,11 @@
 #define APP_TX_DATA_SIZE  2048
 /* USER CODE BEGIN EXPORTED_DEFINES */
 
+#define RX_BUFFER_SIZE		(uint16_t)8192		// Receive ring size, must hold the largest frame the bootloader accepts
+#define RX_BLOCKS			4					// Receive blocks queued at most in block mode, a power of two
+#define RX_TRANSFER_SIZE	(uint16_t)2048		// Multi-packet OUT transfer size, a multiple of the packet size, at most APP_RX_DATA_SIZE
+#define TX_TRANSFER_SIZE	(APP_TX_DATA_SIZE / 2)	// Largest IN transfer: one half of the transmit queue is sent while the other one is filled
+
 /* USER CODE END EXPORTED_DEFINES */
 
 /**
@@ -111,8 +116,24 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 uint8_t CDC_ReadRxBuffer_FS(uint8_t* Buf, uint16_t Len, uint32_t timeout);
 uint16_t CDC_GetRxBufferBytesAvailable_FS(void);
+uint16_t CDC_PeekRxBuffer_FS(const uint8_t **Buf);
+void CDC_CommitRxBuffer_FS(uint16_t Len);
 void CDC_FlushRxBuffer_FS();
 
+void CDC_StartRxBlocks_FS(uint16_t BlockSize);
+void CDC_StopRxBlocks_FS(void);
+uint8_t CDC_QueueRxBlock_FS(uint8_t *Buf);
+uint16_t CDC_GetRxBlock_FS(uint8_t **Buf);
+uint8_t CDC_IsRxBlockPending_FS(void);
+
+void CDC_SetRxTransferSize_FS(uint16_t Size);
+
+uint8_t CDC_WaitTxDone_FS(uint32_t timeout);
+uint16_t CDC_GetTxBufferFree_FS(void);
+uint16_t CDC_PeekTxBuffer_FS(uint8_t **Buf);
+void CDC_CommitTxBuffer_FS(uint16_t Len);
+void CDC_FlushTxBuffer_FS(void);
+
 
 //uint16_t CDC_Get_Received_Data_FS(uint8_t *packet_buffer, uint32_t timeout);
 
@@ -0,0 +1,885 @@
+#
+import os
+import sys
+import time
+import argparse
+import tempfile
+#
+from serial_api import *
+
+
+''' Constants '''
+
+APP_SECTOR_SIZES_KB = {4: 64, 5: 128, 6: 128, 7: 128}      # Application sectors of the STM32F411 and their size
+APP_SIZE_KB = sum(APP_SECTOR_SIZES_KB.values())             # Size of the application area
+
+
+''' Functions '''
+
+"""
+Function: LOG
+Description: Discards the per-packet log messages, only the benchmark results are printed.
+@param message: The log message.
+@return: None
+"""
+def LOG(message):
+    pass
+
+
+"""
+Function: print_timing_breakdown
+Description: Prints where the bootloader spent the time of the last download.
+@param stats: The performance counters returned by GetStats.
+@return: None
+"""
+def print_timing_breakdown(stats):
+
+    if stats is None:
+        return
+
+    ms = lambda cycles: cycles * 1000.0 / stats['core_clock_hz']
+    program = stats['program_cycles']
+    overlap = 100.0 * stats['program_overlap_cycles'] / program if program else 0.0
+
+    print("{:>18} download {:.1f} ms | receive {:.1f} ms | program {:.1f} ms ({:.0f}% overlapped) | erase {:.1f} ms | wait {:.1f} ms".format(
+        "", ms(stats['download_cycles']), ms(stats['receive_cycles']), ms(program), overlap,
+        ms(stats.get('erase_cycles', 0)), ms(stats['wait_cycles'])))
+
+    if stats.get('ring_copy_cycles'):
+        print("{:>18} receive ring copy {:.2f} bytes/cycle".format("", stats['ring_copy_bytes'] / stats['ring_copy_cycles']))
+
+    if 'rx_stalls' in stats:
+        print("{:>18} receive ring peak {} bytes | {} stalls, {:.1f} ms held off".format(
+            "", stats['rx_high_water'], stats['rx_stalls'], ms(stats['rx_stall_cycles'])))
+
+    # Without the transmit queue every response was an IN transfer of its own
+    if 'tx_messages' in stats:
+        print("{:>18} responses {} | IN transfers {} | IN packets {} | dropped {}".format(
+            "", stats['tx_messages'], stats['tx_transfers'], stats['tx_packets'], stats['tx_dropped']))
+
+    # The CPU is busy for the part of the download it didn't sleep, the rest is left to the USB, flash and DMA
+    if stats.get('download_cycles') and 'sleep_cycles' in stats:
+        print("{:>18} CPU busy {:.0f}% | asleep {:.1f} ms | {} task steps".format(
+            "", 100.0 - 100.0 * stats['sleep_cycles'] / stats['download_cycles'], ms(stats['sleep_cycles']), stats['task_steps']))
+
+
+"""
+Function: benchmark_erase
+Description: Measures the blank check cost against the erase cost, then downloads growing prefixes of a
+             binary file and compares the time spent erasing the sectors each image covers with the time
+             needed to erase the whole application area.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file, its prefixes are downloaded then the whole file last.
+@param sizes_kb: The list of image sizes to measure, in kilobytes.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_erase(serial_port, path_to_file, sizes_kb, session_flags=0):
+
+    file_size, file_data = LoadBinaryFile(path_to_file, 4)
+
+    # The first erase wipes the sectors holding data, the second one finds them all blank
+    stats = [GetStats(serial_port, LOG) if SendCMD(serial_port, CMD_ID_ERASE_APP, LOG) == CMD_RESP_STATUS_OK else None
+             for _ in range(2)]
+
+    if None in stats:
+        print("Erase of the application area failed")
+        return
+
+    ms = lambda cycles: cycles * 1000.0 / stats[0]['core_clock_hz']
+    erased_kb = sum(APP_SECTOR_SIZES_KB[n] for n in APP_SECTOR_SIZES_KB if stats[0]['erased_sectors'] & (1 << n))
+
+    if erased_kb == 0:
+        print("The application area was already blank, download an image first")
+        return
+
+    # Sector erase time grows with the sector size, scale it to the whole application area
+    full_erase = ms(stats[0]['erase_cycles']) * sum(APP_SECTOR_SIZES_KB.values()) / erased_kb
+    blank_check = ms(stats[1]['blank_check_cycles'])
+
+    print("Erase: {:.1f} ms for {} KB, whole application area {:.1f} ms".format(ms(stats[0]['erase_cycles']), erased_kb, full_erase))
+
+    # Executing from flash, nothing is serviced while a sector erases: not even the USB interrupt
+    if 'tick_latency_max' in stats[0]:
+        print("Interrupts held off up to {:.1f} ms during the erase ({} flash jobs)".format(
+            ms(stats[0]['tick_latency_max']), stats[0]['flash_jobs']))
+
+    print("Blank check: {:.2f} ms for the whole application area ({} erases skipped), {:.0f}x cheaper than erasing".format(
+        blank_check, stats[1]['erases_skipped'], full_erase / blank_check if blank_check else float('inf')))
+    print("")
+    print("{:>12} {:>8} {:>12} {:>12}".format("image (KB)", "sectors", "erase (ms)", "saved (ms)"))
+
+    sizes = [size * 1024 for size in sizes_kb if 0 < size * 1024 < file_size] + [file_size]
+
+    for size in sizes:
+        with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as image:
+            image.write(file_data[:size])
+
+        try:
+            downloaded = SendBinaryFileWindowed(serial_port, image.name, LOG, session_flags=session_flags)
+        finally:
+            os.remove(image.name)
+
+        stats = GetStats(serial_port, LOG) if downloaded else None
+
+        if stats is None:
+            print("{:>12.1f} {:>8}".format(size / 1024, "failed"))
+            continue
+
+        erase = ms(stats['erase_cycles'])
+        sectors = bin(stats['erased_sectors']).count("1")
+        print("{:>12.1f} {:>8} {:>12.1f} {:>12.1f}".format(size / 1024, sectors, erase, full_erase - erase))
+
+
+"""
+Function: benchmark_latency
+Description: Downloads a binary file so that the application area holds data, then erases it while polling
+             the performance counters, and reports how long the bootloader takes to answer meanwhile. The
+             interrupt handlers run from flash, so the answers wait for each sector erase to end.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file, downloaded first.
+@param session_flags: The SESSION_FLAG_* options of the download.
+@return: None
+"""
+def benchmark_latency(serial_port, path_to_file, session_flags=0):
+
+    if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, session_flags=session_flags):
+        print("Download failed")
+        return
+
+    latencies = []
+    serial_port.reset_input_buffer()
+    serial_port.write(bytes([CMD_ID_ERASE_APP] + [0]*6))
+
+    # Poll until the erase acknowledgment comes in place of the counters
+    while True:
+        sent = time.perf_counter()
+        serial_port.write(bytes([CMD_ID_GET_STATS] + [0]*6))
+        response = serial_port.read(RESP_SIZE)
+
+        if len(response) != RESP_SIZE or response[0] == CMD_ID_ERROR:
+            print("Erase of the application area failed")
+            return
+
+        if response[0] != CMD_ID_STATS:
+            break
+
+        serial_port.read(response[1] * 4)
+        latencies.append((time.perf_counter() - sent) * 1000)
+
+    # The last poll may be answered after the acknowledgment
+    time.sleep(0.1)
+    stats = GetStats(serial_port, LOG)
+
+    if stats is None or not latencies:
+        print("No answer received during the erase")
+        return
+
+    ms = lambda cycles: cycles * 1000.0 / stats['core_clock_hz']
+    latencies.sort()
+
+    print("Erase: {:.1f} ms, {} sectors, answered {} polls".format(
+        ms(stats['erase_cycles']), bin(stats['erased_sectors']).count("1"), len(latencies)))
+    print("Response time: median {:.2f} ms, max {:.2f} ms".format(latencies[len(latencies) // 2], latencies[-1]))
+    print("Interrupts held off up to {:.2f} ms".format(ms(stats['tick_latency_max'])))
+
+
+"""
+Function: benchmark_clock
+Description: Reports the core clock of the bootloader with the CRC throughput, the receive ring copy throughput
+             and the download time it gives. The clock profile is selected when building the bootloader, run
+             it once per profile to compare them.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param runs: The number of downloads, the best one is reported.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_clock(serial_port, path_to_file, runs, session_flags=0):
+
+    file_size, _ = LoadBinaryFile(path_to_file, 4)
+    checksum_size = 64 * 1024
+
+    stats = GetStats(serial_port, LOG) if GetChecksum(serial_port, checksum_size, CHECKSUM_ENGINE_CPU, LOG) is not None else None
+
+    if stats is None:
+        print("Checksum failed")
+        return
+
+    mhz = stats['core_clock_hz'] / 1e6
+    crc_rate = checksum_size * mhz / stats['checksum_cycles']
+    best = None
+
+    for _ in range(runs):
+        start = time.perf_counter()
+        downloaded = SendBinaryFileWindowed(serial_port, path_to_file, LOG, session_flags=session_flags)
+        elapsed = time.perf_counter() - start
+
+        if downloaded and (best is None or elapsed < best[0]):
+            best = (elapsed, GetStats(serial_port, LOG))
+
+    print("Core clock: {:.0f} MHz".format(mhz))
+    print("CRC: {:.2f} MB/s".format(crc_rate))
+
+    if best is None or best[1] is None:
+        print("Download failed")
+        return
+
+    elapsed, stats = best
+
+    # Zero-copy sessions bypass the ring, there is nothing to report then
+    if stats.get('ring_copy_cycles'):
+        print("Receive ring copy: {:.1f} MB/s".format(stats['ring_copy_bytes'] * mhz / stats['ring_copy_cycles']))
+
+    print("Download: {:.3f} s, {:.1f} KB/s".format(elapsed, file_size / 1024 / elapsed))
+    print_timing_breakdown(stats)
+
+
+"""
+Function: benchmark_compress
+Description: Downloads an image raw then compressed, for the binary file and for a near-full image made of
+             copies of it, and reports the compression ratio, the decompression throughput of the bootloader
+             and the end-to-end download time, compression included.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file.
+@param frame_size: The frame size, also the window of the compression.
+@param runs: The number of downloads per configuration, the best one is reported.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_compress(serial_port, path_to_file, frame_size, runs, session_flags=0):
+
+    _, file_data = LoadBinaryFile(path_to_file, 4)
+    near_full = (file_data * (APP_SIZE_KB * 1024 // len(file_data) + 1))[:(APP_SIZE_KB - 8) * 1024]
+
+    print("{:>12} {:>8} {:>14} {:>10} {:>16} {:>14}".format("image (KB)", "ratio", "inflate (MB/s)", "raw (s)", "compressed (s)", "host (s)"))
+
+    for image_data in [file_data, near_full]:
+        with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as image:
+            image.write(image_data)
+
+        try:
+            start = time.perf_counter()
+            blocks = [image_data[i:i + frame_size] for i in range(0, len(image_data), frame_size)]
+            compressed_size = sum(min(-(-len(CompressLZSS(block)) // 4) * 4, len(block)) for block in blocks)
+            host = time.perf_counter() - start
+
+            results = {}
+
+            for compress in [False, True]:
+                best = None
+
+                for _ in range(runs):
+                    start = time.perf_counter()
+                    downloaded = SendBinaryFileWindowed(serial_port, image.name, LOG, frame_size, session_flags=session_flags, compress=compress)
+                    elapsed = time.perf_counter() - start
+
+                    if downloaded and (best is None or elapsed < best[0]):
+                        best = (elapsed, GetStats(serial_port, LOG))
+
+                results[compress] = best
+        finally:
+            os.remove(image.name)
+
+        if None in results.values() or results[True][1] is None:
+            print("{:>12.1f} {:>8}".format(len(image_data) / 1024, "failed"))
+            continue
+
+        stats = results[True][1]
+        inflate = stats['inflated_bytes'] * (stats['core_clock_hz'] / 1e6) / stats['inflate_cycles'] if stats['inflate_cycles'] else 0.0
+
+        print("{:>12.1f} {:>8.2f} {:>14.2f} {:>10.3f} {:>16.3f} {:>14.3f}".format(
+            len(image_data) / 1024, compressed_size / len(image_data), inflate, results[False][0], results[True][0], host))
+
+
+"""
+Function: typical_edits
+Description: Makes up typical updates of an image: a few bytes changed in place, and code inserted which
+             shifts the rest of the image.
+@param image: The installed image.
+@return: The list of (name, new image).
+"""
+def typical_edits(image):
+
+    middle, third = len(image) // 2, len(image) // 3
+
+    return [("16 B changed", image[:middle] + bytes(b ^ 0x5A for b in image[middle:middle + 16]) + image[middle + 16:]),
+            ("64 B inserted", image[:third] + bytes(range(64)) + image[third:])]
+
+
+"""
+Function: benchmark_delta
+Description: Updates the application from an installed image, once with the whole new image and once with the
+             patches against the installed one, and reports the size sent and the download time of both.
+             Without an installed image, the binary file is installed and updated with typical_edits.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the new binary file, or to the installed one without path_to_installed.
+@param path_to_installed: The path to the installed binary file, None to make up the edits.
+@param frame_size: The frame size.
+@param runs: The number of downloads per configuration, the best one is reported.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_delta(serial_port, path_to_file, path_to_installed, frame_size, runs, session_flags=0):
+
+    if path_to_installed:
+        _, installed = LoadBinaryFile(path_to_installed, 4)
+        _, new_data = LoadBinaryFile(path_to_file, 4)
+        cases = [("file", new_data)]
+    else:
+        _, installed = LoadBinaryFile(path_to_file, 4)
+        cases = typical_edits(installed)
+
+    print("{:>14} {:>10} {:>10} {:>12} {:>10} {:>10}".format("update", "image (KB)", "sent (KB)", "copied (KB)", "full (s)", "delta (s)"))
+
+    with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as installed_file:
+        installed_file.write(installed)
+
+    try:
+        for name, new_data in cases:
+            with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as image:
+                image.write(new_data)
+
+            messages = []
+            results = {}
+
+            try:
+                for delta in [False, True]:
+                    best = None
+
+                    for _ in range(runs):
+                        # Each update starts from the installed image
+                        if not SendBinaryFileWindowed(serial_port, installed_file.name, LOG, frame_size, session_flags=session_flags):
+                            break
+
+                        del messages[:]
+                        start = time.perf_counter()
+                        if delta:
+                            downloaded = SendBinaryFileDelta(serial_port, image.name, installed_file.name, messages.append, frame_size=frame_size, session_flags=session_flags)
+                        else:
+                            downloaded = SendBinaryFileWindowed(serial_port, image.name, LOG, frame_size, session_flags=session_flags)
+                        elapsed = time.perf_counter() - start
+
+                        if downloaded and (best is None or elapsed < best[0]):
+                            sent = [int(message.split()[-2]) for message in messages if message.startswith("Encoded to")]
+                            best = (elapsed, GetStats(serial_port, LOG), sent[-1] if sent else len(new_data))
+
+                    results[delta] = best
+            finally:
+                os.remove(image.name)
+
+            if None in results.values() or results[True][1] is None:
+                print("{:>14} {:>10}".format(name, "failed"))
+                continue
+
+            print("{:>14} {:>10.1f} {:>10.1f} {:>12.1f} {:>10.3f} {:>10.3f}".format(
+                name, len(new_data) / 1024, results[True][2] / 1024, results[True][1]['delta_copy_bytes'] / 1024, results[False][0], results[True][0]))
+    finally:
+        os.remove(installed_file.name)
+
+
+"""
+Function: benchmark_sync
+Description: Installs the binary file, then updates it with typical_edits and unchanged, once with the whole
+             image and once with the blocks that changed only, and reports the blocks sent and the update time
+             of both, the block checksums and the final check of the sync included.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file.
+@param frame_size: The frame size, also the block size.
+@param runs: The number of downloads per configuration, the best one is reported.
+@return: None
+"""
+def benchmark_sync(serial_port, path_to_file, frame_size, runs):
+
+    _, installed = LoadBinaryFile(path_to_file, 4)
+
+    print("{:>14} {:>10} {:>14} {:>10} {:>10}".format("update", "image (KB)", "blocks sent", "full (s)", "sync (s)"))
+
+    with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as installed_file:
+        installed_file.write(installed)
+
+    try:
+        for name, new_data in typical_edits(installed) + [("unchanged", installed)]:
+            with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as image:
+                image.write(new_data)
+
+            messages = []
+            results = {}
+
+            try:
+                for sync in [False, True]:
+                    best = None
+
+                    for _ in range(runs):
+                        # Each update starts from the installed image
+                        if not SendBinaryFileWindowed(serial_port, installed_file.name, LOG, frame_size):
+                            break
+
+                        del messages[:]
+                        start = time.perf_counter()
+                        if sync:
+                            downloaded = SendBinaryFileSync(serial_port, image.name, messages.append, frame_size)
+                        else:
+                            downloaded = SendBinaryFileWindowed(serial_port, image.name, LOG, frame_size)
+                        elapsed = time.perf_counter() - start
+
+                        if downloaded and (best is None or elapsed < best[0]):
+                            sent = [message.split(": ")[1] for message in messages if message.startswith("Blocks changed")]
+                            skipped = any(message.startswith("The application already matches") for message in messages)
+                            best = (elapsed, "skipped" if skipped else (sent[-1] if sent else "all"))
+
+                    results[sync] = best
+            finally:
+                os.remove(image.name)
+
+            if None in results.values():
+                print("{:>14} {:>10}".format(name, "failed"))
+                continue
+
+            print("{:>14} {:>10.1f} {:>14} {:>10.3f} {:>10.3f}".format(
+                name, len(new_data) / 1024, results[True][1], results[False][0], results[True][0]))
+    finally:
+        os.remove(installed_file.name)
+
+
+"""
+Function: benchmark_skip
+Description: Installs the binary file, then flashes it again: reports the time of the installation, of the first
+             image information query which checksums the installed image, of the following ones answered from
+             the cache of the bootloader, and of the repeated flashing, skipped on the image information.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file.
+@param runs: The number of measures, the best one is reported.
+@return: None
+"""
+def benchmark_skip(serial_port, path_to_file, runs):
+
+    file_size, _ = LoadBinaryFile(path_to_file, 4)
+    install, first, cached, skip = None, None, None, None
+
+    for _ in range(runs):
+        start = time.perf_counter()
+        if not SendBinaryFileWindowed(serial_port, path_to_file, LOG):
+            print("Download failed")
+            return
+        install = min(install or float("inf"), time.perf_counter() - start)
+
+        # The download invalidated the image information, the first query computes it
+        for query in range(2):
+            start = time.perf_counter()
+            info = GetImageInfo(serial_port, LOG)
+            elapsed = time.perf_counter() - start
+            stats = GetStats(serial_port, LOG)
+
+            if info is None or stats is None:
+                print("Image information failed")
+                return
+
+            measure = (elapsed, stats['checksum_cycles'] / (stats['core_clock_hz'] / 1e6))
+
+            if query == 0:
+                first = measure if first is None or measure < first else first
+            else:
+                cached = measure if cached is None or measure < cached else cached
+
+        messages = []
+        start = time.perf_counter()
+        SendBinaryFileSync(serial_port, path_to_file, messages.append)
+        elapsed = time.perf_counter() - start
+
+        if not any(message.startswith("The application already matches") for message in messages):
+            print("The installed image doesn't match the file, flashing was not skipped")
+            return
+
+        skip = min(skip or float("inf"), elapsed)
+
+    print("Image: " + path_to_file + " (" + str(file_size) + " bytes)")
+    print("Full download: {:.3f} s".format(install))
+    print("First image information: {:.1f} ms, checksum {:.0f} us".format(first[0] * 1e3, first[1]))
+    print("Cached image information: {:.1f} ms, checksum {:.0f} us".format(cached[0] * 1e3, cached[1]))
+    print("Flashing skipped (fast path): {:.3f} s, {:.0f}x faster".format(skip, install / skip))
+
+
+"""
+Function: benchmark_upload
+Description: Reads back the start of the application area with different sizes and reports the read-back
+             throughput, the IN transfers and how often the endpoint ran out of data. Each upload is checked
+             against the checksum of the bootloader.
+@param serial_port: The serial port object.
+@param sizes_kb: The list of sizes to read back, in KB.
+@param runs: The number of uploads per size, the best one is reported.
+@return: None
+"""
+def benchmark_upload(serial_port, sizes_kb, runs):
+
+    print("{:>10} {:>10} {:>10} {:>12} {:>10} {:>8}".format("size (KB)", "time (s)", "KB/s", "transfers", "tx idle", "match"))
+
+    for size_kb in sizes_kb:
+        size = min(size_kb * 1024, APP_SIZE_KB * 1024)
+        best = None
+
+        with tempfile.NamedTemporaryFile(suffix=".bin", delete=False) as upload:
+            pass
+
+        try:
+            for _ in range(runs):
+                start = time.perf_counter()
+                uploaded = UploadFlash(serial_port, APP_BASE_ADDRESS, size, upload.name, LOG)
+                elapsed = time.perf_counter() - start
+
+                if uploaded and (best is None or elapsed < best[0]):
+                    best = (elapsed, GetStats(serial_port, LOG))
+
+            with open(upload.name, "rb") as file:
+                match = best is not None and calculateCRC32(file.read()) == GetChecksum(serial_port, size, CHECKSUM_ENGINE_CPU, LOG)
+        finally:
+            os.remove(upload.name)
+
+        if best is None or best[1] is None:
+            print("{:>10} {:>10}".format(size_kb, "failed"))
+            continue
+
+        elapsed, stats = best
+        print("{:>10} {:>10.3f} {:>10.1f} {:>12} {:>10} {:>8}".format(
+            size // 1024, elapsed, size / 1024 / elapsed, stats['tx_transfers'], stats['tx_idle'], "yes" if match else "NO"))
+
+
+"""
+Function: benchmark_window
+Description: Downloads the same binary file with different frame and window sizes and reports the goodput.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param frame_sizes: The list of frame sizes to measure.
+@param window_sizes: The list of window sizes to measure, 0 stands for the largest the bootloader accepts.
+@param runs: The number of downloads per configuration.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_window(serial_port, path_to_file, frame_sizes, window_sizes, runs, session_flags=0):
+
+    file_size, _ = LoadBinaryFile(path_to_file, 4)
+
+    print("Image: " + path_to_file + " (" + str(file_size) + " bytes)")
+    print("{:>8} {:>8} {:>12} {:>16}".format("frame", "window", "time (s)", "goodput (KB/s)"))
+
+    for frame_size in frame_sizes:
+        for window_size in window_sizes:
+            elapsed = []
+
+            for _ in range(runs):
+                start = time.perf_counter()
+
+                if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size, window_size or None, session_flags):
+                    print("{:>8} {:>8} {:>12}".format(frame_size, window_size, "failed"))
+                    break
+
+                elapsed.append(time.perf_counter() - start)
+
+            if len(elapsed) == runs:
+                best = min(elapsed)
+                print("{:>8} {:>8} {:>12.3f} {:>16.1f}".format(frame_size, window_size or "max", best, file_size / best / 1024))
+                print_timing_breakdown(GetStats(serial_port, LOG))
+
+
+"""
+Function: benchmark_engine
+Description: Downloads the same binary file with the HAL word by word programming and with the burst
+             programming engine of the bootloader, and reports the programming rate of each one.
+             The bootloader programs with a word parallelism, the 2.7 V - 3.6 V voltage range.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param runs: The number of downloads per engine.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_engine(serial_port, path_to_file, runs, session_flags=0):
+
+    engines = [("HAL", session_flags | SESSION_FLAG_HAL_PROGRAM), ("burst", session_flags & ~SESSION_FLAG_HAL_PROGRAM)]
+
+    print("Image: " + path_to_file + " (voltage range 2.7 V - 3.6 V, word parallelism)")
+    print("{:>8} {:>12} {:>16} {:>14}".format("engine", "words", "program (ms)", "words/s"))
+
+    for name, flags in engines:
+        best = None
+
+        for _ in range(runs):
+            if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, session_flags=flags):
+                break
+
+            stats = GetStats(serial_port, LOG)
+            if stats is not None and (best is None or stats['program_cycles'] < best['program_cycles']):
+                best = stats
+
+        if best is None or best['program_cycles'] == 0:
+            print("{:>8} {:>12}".format(name, "failed"))
+            continue
+
+        seconds = best['program_cycles'] / best['core_clock_hz']
+        print("{:>8} {:>12} {:>16.1f} {:>14.0f}".format(name, best['programmed_words'], seconds * 1000, best['programmed_words'] / seconds))
+
+
+"""
+Function: benchmark_verify
+Description: Downloads the same binary file with each verify policy of the bootloader and reports the total
+             download time and the part spent verifying.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param runs: The number of downloads per policy.
+@param session_flags: The SESSION_FLAG_* options of the downloads, the verify policy is replaced.
+@return: None
+"""
+def benchmark_verify(serial_port, path_to_file, runs, session_flags=0):
+
+    policies = [("none", SESSION_VERIFY_NONE), ("crc", SESSION_VERIFY_CRC), ("readback", SESSION_VERIFY_READBACK)]
+
+    print("Image: " + path_to_file)
+    print("{:>10} {:>12} {:>16} {:>14}".format("policy", "time (s)", "download (ms)", "verify (ms)"))
+
+    for name, policy in policies:
+        flags = (session_flags & ~SESSION_VERIFY_MASK) | policy
+        best = None
+
+        for _ in range(runs):
+            start = time.perf_counter()
+
+            if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, session_flags=flags):
+                break
+
+            elapsed = time.perf_counter() - start
+            stats = GetStats(serial_port, LOG)
+
+            if stats is not None and (best is None or elapsed < best[0]):
+                best = (elapsed, stats)
+
+        if best is None:
+            print("{:>10} {:>12}".format(name, "failed"))
+            continue
+
+        elapsed, stats = best
+        ms = lambda cycles: cycles * 1000.0 / stats['core_clock_hz']
+        print("{:>10} {:>12.3f} {:>16.1f} {:>14.1f}".format(name, elapsed, ms(stats['download_cycles']), ms(stats['verify_cycles'])))
+
+
+"""
+Function: benchmark_tail
+Description: Downloads the same binary file with the running image CRC and with a full re-read of the image,
+             and reports the tail latency between the last frame acknowledged and the final acknowledgment.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param runs: The number of downloads per mode.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_tail(serial_port, path_to_file, runs, session_flags=0):
+
+    modes = [("re-read", session_flags | SESSION_FLAG_REREAD), ("running", session_flags & ~SESSION_FLAG_REREAD)]
+
+    print("Image: " + path_to_file)
+    print("{:>10} {:>12}".format("checksum", "tail (ms)"))
+
+    for name, flags in modes:
+        tails = []
+
+        for _ in range(runs):
+            if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, session_flags=flags):
+                break
+
+            stats = GetStats(serial_port, LOG)
+            if stats is not None:
+                tails.append(stats['tail_cycles'] * 1000.0 / stats['core_clock_hz'])
+
+        if len(tails) == 0:
+            print("{:>10} {:>12}".format(name, "failed"))
+        else:
+            print("{:>10} {:>12.3f}".format(name, min(tails)))
+
+
+"""
+Function: benchmark_zero_copy
+Description: Downloads the same binary file through the receive ring and in zero-copy mode, and reports the
+             cycles spent per received kilobyte: storing the packets in the USB interrupt, then moving and
+             checking the frames in the download loop.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param frame_size: The frame size of the downloads.
+@param runs: The number of downloads per path.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_zero_copy(serial_port, path_to_file, frame_size, runs, session_flags=0):
+
+    paths = [("ring", session_flags & ~SESSION_FLAG_ZERO_COPY), ("zero-copy", session_flags | SESSION_FLAG_ZERO_COPY)]
+    file_size, _ = LoadBinaryFile(path_to_file, 4)
+    kb = file_size / 1024.0
+
+    print("Image: " + path_to_file + ", frame size " + str(frame_size))
+    print("{:>10} {:>12} {:>16} {:>16} {:>14}".format("path", "time (s)", "isr (cyc/KB)", "loop (cyc/KB)", "total (cyc/KB)"))
+
+    for name, flags in paths:
+        best = None
+
+        for _ in range(runs):
+            start = time.perf_counter()
+
+            if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size, session_flags=flags):
+                break
+
+            elapsed = time.perf_counter() - start
+            stats = GetStats(serial_port, LOG)
+
+            if stats is not None and (best is None or elapsed < best[0]):
+                best = (elapsed, stats)
+
+        if best is None:
+            print("{:>10} {:>12}".format(name, "failed"))
+            continue
+
+        elapsed, stats = best
+        isr = stats['rx_isr_cycles'] / kb
+        loop = stats['receive_cycles'] / kb
+        print("{:>10} {:>12.3f} {:>16.0f} {:>16.0f} {:>14.0f}".format(name, elapsed, isr, loop, isr + loop))
+
+
+"""
+Function: benchmark_transfer
+Description: Downloads the same binary file with the OUT endpoint of the bootloader armed packet by packet,
+             then for multi-packet transfers, and reports the throughput with the USB interrupts and the
+             receive callbacks per received kilobyte.
+@param serial_port: The serial port object.
+@param path_to_file: The path to the binary file to download.
+@param frame_size: The frame size of the downloads.
+@param runs: The number of downloads per mode.
+@param session_flags: The SESSION_FLAG_* options of the downloads.
+@return: None
+"""
+def benchmark_transfer(serial_port, path_to_file, frame_size, runs, session_flags=0):
+
+    modes = [("packet", session_flags | SESSION_FLAG_SINGLE_PACKET), ("transfer", session_flags & ~SESSION_FLAG_SINGLE_PACKET)]
+    file_size, _ = LoadBinaryFile(path_to_file, 4)
+    kb = file_size / 1024.0
+
+    print("Image: " + path_to_file + ", frame size " + str(frame_size))
+    print("{:>10} {:>12} {:>12} {:>12} {:>16}".format("receive", "time (s)", "KB/s", "irq/KB", "callbacks/KB"))
+
+    for name, flags in modes:
+        best = None
+
+        for _ in range(runs):
+            start = time.perf_counter()
+
+            if not SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size, session_flags=flags):
+                break
+
+            elapsed = time.perf_counter() - start
+            stats = GetStats(serial_port, LOG)
+
+            if stats is not None and (best is None or elapsed < best[0]):
+                best = (elapsed, stats)
+
+        if best is None:
+            print("{:>10} {:>12}".format(name, "failed"))
+            continue
+
+        elapsed, stats = best
+        print("{:>10} {:>12.3f} {:>12.1f} {:>12.1f} {:>16.1f}".format(name, elapsed, kb / elapsed, stats['usb_irqs'] / kb, stats['rx_transfers'] / kb))
+
+
+"""
+Function: benchmark_checksum
+Description: Computes the checksum of growing parts of the application area with the CRC unit fed by the CPU
+             then by the DMA, and reports the time of each one. While the DMA runs, the bootloader state
+             machine keeps running, the number of passes it made is reported.
+@param serial_port: The serial port object.
+@param sizes_kb: The list of area sizes to measure, in kilobytes.
+@return: None
+"""
+def benchmark_checksum(serial_port, sizes_kb):
+
+    engines = [("cpu", CHECKSUM_ENGINE_CPU), ("dma", CHECKSUM_ENGINE_DMA)]
+
+    print("{:>10} {:>8} {:>12} {:>14} {:>12}".format("size (KB)", "engine", "time (ms)", "rate (MB/s)", "polls"))
+
+    for size_kb in sizes_kb:
+        checksums = set()
+
+        for name, engine in engines:
+            checksum = GetChecksum(serial_port, size_kb * 1024, engine, LOG)
+            stats = GetStats(serial_port, LOG) if checksum is not None else None
+
+            if stats is None:
+                print("{:>10} {:>8} {:>12}".format(size_kb, name, "failed"))
+                continue
+
+            checksums.add(checksum)
+            seconds = stats['checksum_cycles'] / stats['core_clock_hz']
+            rate = size_kb / 1024 / seconds if seconds else 0.0
+            print("{:>10} {:>8} {:>12.3f} {:>14.2f} {:>12}".format(size_kb, name, seconds * 1000, rate, stats['checksum_polls']))
+
+        if len(checksums) > 1:
+            print("{:>10} checksums differ between the engines".format(size_kb))
+
+
+''' Main '''
+
+parser = argparse.ArgumentParser(description="Bootloader download throughput benchmark")
+parser.add_argument("port", help="COM port of the bootloader")
+parser.add_argument("file", help="binary file to download")
+parser.add_argument("--frames", type=int, nargs="+", default=[FRAME_MIN_SIZE, 1024, FRAME_MAX_SIZE], help="frame sizes to measure")
+parser.add_argument("--windows", type=int, nargs="+", default=[1, 2, 4, 0], help="window sizes to measure, 0 for the largest accepted")
+parser.add_argument("--runs", type=int, default=3, help="downloads per configuration, the best one is reported")
+parser.add_argument("--staged", action="store_true", help="store-and-forward downloads, the image is staged in RAM before programming")
+parser.add_argument("--checksum", type=int, nargs="*", metavar="KB", help="compare the CPU and DMA fed checksums over these sizes instead")
+parser.add_argument("--tail", action="store_true", help="compare the tail latency of the running and re-read image checksums instead")
+parser.add_argument("--verify", action="store_true", help="compare the download time of the verify policies instead")
+parser.add_argument("--engine", action="store_true", help="compare the HAL and burst flash programming engines instead")
+parser.add_argument("--transfer", action="store_true", help="compare packet by packet and multi-packet reception instead, at the largest frame size given")
+parser.add_argument("--zero-copy", action="store_true", help="compare the receive cost of the ring and zero-copy paths instead, at the largest frame size given")
+parser.add_argument("--erase", type=int, nargs="*", metavar="KB", help="measure the blank check and erase costs, and the erase time saved for these image sizes")
+parser.add_argument("--compress", action="store_true", help="compare raw and compressed downloads of the file and of a near-full image instead, at the largest frame size given")
+parser.add_argument("--delta", nargs="?", const="", metavar="INSTALLED", help="compare full and delta updates from the INSTALLED binary file, or from the file with typical edits, at the largest frame size given")
+parser.add_argument("--sync", action="store_true", help="compare full updates and updates of the changed blocks only, at the largest frame size given")
+parser.add_argument("--skip", action="store_true", help="measure the image information query and the flashing skipped when the file is already installed")
+parser.add_argument("--upload", type=int, nargs="*", metavar="KB", help="measure the read-back throughput of the application area over these sizes instead")
+parser.add_argument("--clock", action="store_true", help="report the core clock with the CRC, receive copy and download throughput it gives")
+parser.add_argument("--latency", action="store_true", help="measure how long the bootloader takes to answer while it erases the application area")
+args = parser.parse_args()
+
+try:
+    serial_port = Connect(args.port)
+except serial.SerialException as e:
+    sys.exit("Error opening serial port: " + str(e))
+
+session_flags = SESSION_FLAG_STAGED if args.staged else 0
+
+if args.checksum is not None:
+    benchmark_checksum(serial_port, args.checksum or [1, 16, 64, 192, 448])
+elif args.tail:
+    benchmark_tail(serial_port, args.file, args.runs, session_flags)
+elif args.verify:
+    benchmark_verify(serial_port, args.file, args.runs, session_flags)
+elif args.engine:
+    benchmark_engine(serial_port, args.file, args.runs, session_flags)
+elif args.transfer:
+    benchmark_transfer(serial_port, args.file, max(args.frames), args.runs, session_flags)
+elif args.zero_copy:
+    benchmark_zero_copy(serial_port, args.file, max(args.frames), args.runs, session_flags)
+elif args.compress:
+    benchmark_compress(serial_port, args.file, max(args.frames), args.runs, session_flags)
+elif args.delta is not None:
+    benchmark_delta(serial_port, args.file, args.delta, max(args.frames), args.runs, session_flags)
+elif args.sync:
+    benchmark_sync(serial_port, args.file, max(args.frames), args.runs)
+elif args.skip:
+    benchmark_skip(serial_port, args.file, args.runs)
+elif args.upload is not None:
+    benchmark_upload(serial_port, args.upload or [16, 64, 256, APP_SIZE_KB], args.runs)
+elif args.clock:
+    benchmark_clock(serial_port, args.file, args.runs, session_flags)
+elif args.latency:
+    benchmark_latency(serial_port, args.file, session_flags)
+elif args.erase is not None:
+    benchmark_erase(serial_port, args.file, args.erase or [4, 16, 64, 128, 256], session_flags)
+else:
+    benchmark_window(serial_port, args.file, args.frames, args.windows, args.runs, session_flags)
+
+serial_port.close()
@@ -172,7 +172,8 @@ def flash():
             elf_to_bin_program_path = os.path.dirname(os.path.abspath(__file__)) + "\\objcopy.exe"
             
             try:
-                result = subprocess.run([elf_to_bin_program_path, '-O', 'binary', file_path, file_name], check=True)
+                # The gaps between the sections are filled as blank flash, the download skips them
+                result = subprocess.run([elf_to_bin_program_path, '-O', 'binary', '--gap-fill', '0xFF', file_path, file_name], check=True)
             
                 if result.returncode == 0:
                     LOG("Conversion from ELF to BIN was successful")
@@ -191,8 +192,9 @@ def flash():
 
         LOG("Flashing onto STM32 the binary file: ./" + file_path)
 
-        # Flash the binary file onto the STM32 
-        SendBinaryFile(serial_port, file_path, LOG)
+        # Flash the blocks of the binary file that changed onto the STM32 with the windowed protocol, then start it
+        if SendBinaryFileSync(serial_port, file_path, LOG):
+            execute()
 
 
 """
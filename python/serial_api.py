@@ -1,4 +1,5 @@
 
+import bisect
 import struct
 import crcmod
 import serial
@@ -7,6 +8,58 @@ import serial
 # Command/Response Size
 CMD_SIZE                    = 7
 RESP_SIZE                   = 3
+WIN_ACK_SIZE                = 7
+IMAGE_INFO_SIZE             = 9         # ID, length (4), checksum (4)
+
+# Windowed download
+FRAME_HEADER_SIZE           = 12        # ID, flags, sequence number, length, block, CRC
+FRAME_MIN_SIZE              = 64        # Default frame size, also the frame size granularity
+FRAME_MAX_SIZE              = 4096      # Largest frame the bootloader accepts
+FRAME_DEFAULT_SIZE          = 1024
+WIN_MAX_TIMEOUTS            = 3         # Consecutive acknowledgment timeouts before giving up
+USB_PACKET_SIZE             = 64        # Full speed bulk packet size, zero-copy frames are padded to a multiple of it
+
+# Frame Flags
+FRAME_FLAG_COMPRESSED       = 0x80      # The frame payload is LZSS compressed
+FRAME_FLAG_DELTA            = 0x40      # The frame payload is a patch against the installed application
+FRAME_FLAG_FILL             = 0x20      # A filler word follows the payload, outside its length and CRC
+FRAME_FLAG_PAD_MASK         = 0x03      # Bytes padding a compressed or patch payload to a whole word
+FRAME_FILL_SIZE             = 4         # Filler sent when the frame would otherwise end on a USB packet boundary
+
+# LZSS compression of the frames, each frame on its own
+LZSS_MIN_MATCH              = 3         # Shortest match, encoded as length 0
+LZSS_MAX_MATCH              = 18        # Longest match, 4 bits of length
+LZSS_WINDOW                 = 4096      # Farthest match, 12 bits of distance
+LZSS_CANDIDATES             = 32        # Earlier positions tried for each match
+
+# Patches against the installed application, each frame rebuilt on its own
+DELTA_OP_COPY               = 0x01      # Length (2), offset in the application area (4)
+DELTA_OP_INSERT             = 0x02      # Length (2), then the bytes
+DELTA_KEY_SIZE              = 8         # Bytes indexing the installed application
+DELTA_MIN_COPY              = 12        # Shortest copy worth its 7 bytes
+DELTA_CANDIDATES            = 16        # Positions of the installed application tried for each copy, the closest ones
+
+# Flash of the STM32F411, the upload addresses are offsets from its base
+FLASH_BASE_ADDRESS          = 0x08000000
+FLASH_SIZE                  = 512 * 1024
+APP_BASE_ADDRESS            = 0x08010000
+UPLOAD_READ_SIZE            = 16 * 1024 # Bytes read from the serial port and written to the file at once
+
+# Application area of the STM32F411: sectors 4 to 7, offsets of their bounds
+APP_SECTOR_BOUNDS           = [0x00000, 0x10000, 0x30000, 0x50000, 0x70000]
+SYNC_KEPT_SECTOR            = 0         # The one sector a sync download keeps in RAM while erased, if it fits the staging area
+
+# Session Flags
+SESSION_FLAG_STAGED         = 0x01      # Store-and-forward: the image is verified in RAM before the flash is erased
+STAGING_SIZE                = 64 * 1024 # RAM staging area of the store-and-forward mode, programmed chunk by chunk, unless the session reports it
+SESSION_FLAG_HAL_PROGRAM    = 0x02      # Program word by word through the HAL instead of the burst engine
+SESSION_VERIFY_CRC          = 0x00      # Verify each programmed block against its CRC with the CRC unit (default)
+SESSION_VERIFY_NONE         = 0x04      # Don't verify the programmed blocks, only the image checksum
+SESSION_VERIFY_READBACK     = 0x08      # Read back and compare every programmed word
+SESSION_VERIFY_MASK         = 0x0C
+SESSION_FLAG_REREAD         = 0x10      # Re-read the whole image for the final checksum instead of the running CRC
+SESSION_FLAG_ZERO_COPY      = 0x20      # Frames padded to whole USB packets, received in place by the bootloader
+SESSION_FLAG_SINGLE_PACKET  = 0x40      # The bootloader receives packet by packet instead of multi-packet transfers
 
 # Command Response Status
 CMD_RESP_STATUS_OK          = 0
@@ -27,6 +80,26 @@ CMD_ID_ERROR			    = 0x50
 CMD_ID_EXECUTE			    = 0x60
 CMD_ID_ERASE_APP		    = 0x70
 CMD_ID_DOWNLOAD_FW		    = 0x80
+CMD_ID_DOWNLOAD_WIN         = 0x90
+CMD_ID_WIN_ACK              = 0x91
+CMD_ID_DOWNLOAD_SEG         = 0x92
+CMD_ID_DOWNLOAD_SYNC        = 0x93
+CMD_ID_DELTA_NACK           = 0x94
+CMD_ID_SESSION              = 0xA0
+CMD_ID_SESSION_INFO         = 0xA1
+CMD_ID_GET_STATS            = 0xB0
+CMD_ID_STATS                = 0xB1
+CMD_ID_CHECKSUM             = 0xC0
+CMD_ID_CHECKSUM_INFO        = 0xC1
+CMD_ID_BLOCK_HASH           = 0xC2
+CMD_ID_BLOCK_HASH_INFO      = 0xC3
+CMD_ID_GET_IMAGE_INFO       = 0xC4
+CMD_ID_IMAGE_INFO           = 0xC5
+CMD_ID_UPLOAD               = 0xD0
+
+# Checksum Engines
+CHECKSUM_ENGINE_CPU         = 0         # The CPU feeds the CRC unit
+CHECKSUM_ENGINE_DMA         = 1         # The DMA feeds the CRC unit
 
 CMD_NAME_LIST = {
 
@@ -37,9 +110,68 @@ CMD_NAME_LIST = {
     CMD_ID_ERROR        : 'ERROR',
     CMD_ID_EXECUTE      : 'EXECUTE',
     CMD_ID_ERASE_APP    : 'ERASE_APP',
-    CMD_ID_DOWNLOAD_FW  : 'DOWNLOAD_FW'
+    CMD_ID_DOWNLOAD_FW  : 'DOWNLOAD_FW',
+    CMD_ID_DOWNLOAD_WIN : 'DOWNLOAD_WIN',
+    CMD_ID_WIN_ACK      : 'WIN_ACK',
+    CMD_ID_DOWNLOAD_SEG : 'DOWNLOAD_SEG',
+    CMD_ID_DOWNLOAD_SYNC: 'DOWNLOAD_SYNC',
+    CMD_ID_DELTA_NACK   : 'DELTA_NACK',
+    CMD_ID_SESSION      : 'SESSION',
+    CMD_ID_SESSION_INFO : 'SESSION_INFO',
+    CMD_ID_GET_STATS    : 'GET_STATS',
+    CMD_ID_STATS        : 'STATS',
+    CMD_ID_CHECKSUM     : 'CHECKSUM',
+    CMD_ID_CHECKSUM_INFO: 'CHECKSUM_INFO',
+    CMD_ID_BLOCK_HASH   : 'BLOCK_HASH',
+    CMD_ID_BLOCK_HASH_INFO: 'BLOCK_HASH_INFO',
+    CMD_ID_GET_IMAGE_INFO: 'GET_IMAGE_INFO',
+    CMD_ID_IMAGE_INFO   : 'IMAGE_INFO',
+    CMD_ID_UPLOAD       : 'UPLOAD'
 }
 
+# Performance counters, in the order the bootloader reports them
+STATS_NAME_LIST = [
+    'core_clock_hz',
+    'download_cycles',
+    'receive_cycles',
+    'program_cycles',
+    'program_overlap_cycles',
+    'wait_cycles',
+    'frames',
+    'erase_cycles',
+    'erased_sectors',
+    'blank_check_cycles',
+    'erases_skipped',
+    'programmed_words',
+    'verify_cycles',
+    'tail_cycles',
+    'checksum_cycles',
+    'checksum_polls',
+    'ring_copy_cycles',
+    'ring_copy_bytes',
+    'rx_stall_cycles',
+    'rx_stalls',
+    'rx_high_water',
+    'rx_isr_cycles',
+    'usb_irqs',
+    'rx_transfers',
+    'tx_messages',
+    'tx_dropped',
+    'tx_transfers',
+    'tx_packets',
+    'sleep_cycles',
+    'task_steps',
+    'flash_jobs',
+    'flash_job_cycles',
+    'tick_latency_max',
+    'inflate_cycles',
+    'inflated_bytes',
+    'delta_copy_bytes',
+    'kept_bytes',
+    'tx_idle',
+    'upload_bytes'
+]
+
 # Errors
 BL_CHKS_MISMATCH			= 0x7F 		# Application checksum incorrect
 BL_CMD_INVALID              = 0x80		# Invalid command
@@ -47,6 +179,8 @@ BL_INVALID_STATE            = 0x81		# Invalid state
 BL_RECEIVE_TIMEOUT          = 0x82		# Receive timeout reached
 BL_DOWNLOAD_FAILED          = 0x83		# Firmware download failed
 BL_NO_USER_APP              = 0x84		# No user application found
+BL_VERIFY_FAILED            = 0x85		# Programmed data doesn't match after writing
+BL_DELTA_SOURCE_LOST        = 0x86		# A patch copies data the download has already overwritten
 
 ERROR_NAME_LIST = {
     
@@ -55,7 +189,9 @@ ERROR_NAME_LIST = {
     BL_INVALID_STATE    : "INVALID BOOTLOADER STATE", 
     BL_RECEIVE_TIMEOUT  : "RECEIVE TIMEOUT",
     BL_DOWNLOAD_FAILED  : "DOWNLOAD FAILED",
-    BL_NO_USER_APP      : "USER APPLICATION NOT FOUND"
+    BL_NO_USER_APP      : "USER APPLICATION NOT FOUND",
+    BL_VERIFY_FAILED    : "FLASH VERIFICATION FAILED",
+    BL_DELTA_SOURCE_LOST: "PATCH SOURCE ALREADY OVERWRITTEN"
 }
 
 
@@ -307,6 +443,787 @@ def SendBinaryFile(serial_port, path_to_file, LOG):
         LOG("Error while sending binary file: " + str(e))
 
 
+"""
+Function: LoadBinaryFile
+Description: Reads a binary file and pads it with zeros to a multiple of the packet size.
+@param path_to_file: The path to the binary file.
+@param packet_size: The size of the packets the file will be split into.
+@return: A tuple (original file size, padded file data).
+"""
+def LoadBinaryFile(path_to_file, packet_size):
+
+    with open(path_to_file, "rb") as file:
+        file_data = file.read()
+
+    file_size = len(file_data)
+    file_data += bytes((-file_size) % packet_size)
+
+    return file_size, file_data
+
+
+"""
+Function: CompressLZSS
+Description: Compresses data with the LZSS format the bootloader decompresses. The output is a sequence of
+             groups: a flag byte then eight items, a literal byte for a flag bit set, otherwise a match of two
+             bytes: the distance minus 1 on 12 bits (low byte first, then the upper nibble of the second byte),
+             and the length minus LZSS_MIN_MATCH on the lower nibble of the second byte.
+@param data: The data to compress, a frame payload.
+@return: The compressed data.
+"""
+def CompressLZSS(data):
+
+    out = bytearray()
+    heads = {}                  # 3 bytes prefix -> positions it was seen at
+    pos = 0
+
+    while pos < len(data):
+        flag_index = len(out)
+        out.append(0)
+
+        for bit in range(8):
+            if pos >= len(data):
+                break
+
+            best_length, best_distance = 0, 0
+            limit = min(LZSS_MAX_MATCH, len(data) - pos)
+
+            # The most recent positions first, the closest match wins a tie
+            for candidate in reversed(heads.get(data[pos:pos + LZSS_MIN_MATCH], [])[-LZSS_CANDIDATES:]):
+                if pos - candidate > LZSS_WINDOW:
+                    break
+
+                length = LZSS_MIN_MATCH
+                while length < limit and data[candidate + length] == data[pos + length]:
+                    length += 1
+
+                if length > best_length:
+                    best_length, best_distance = length, pos - candidate
+                    if length == limit:
+                        break
+
+            if best_length >= LZSS_MIN_MATCH:
+                out += bytes([(best_distance - 1) & 0xFF, (((best_distance - 1) >> 4) & 0xF0) | (best_length - LZSS_MIN_MATCH)])
+                step = best_length
+            else:
+                out[flag_index] |= 1 << bit
+                out.append(data[pos])
+                step = 1
+
+            for i in range(pos, min(pos + step, len(data) - LZSS_MIN_MATCH + 1)):
+                heads.setdefault(data[i:i + LZSS_MIN_MATCH], []).append(i)
+
+            pos += step
+
+    return bytes(out)
+
+
+"""
+Function: AppSectors
+Description: Lists the sectors of the application area a range of it lies in.
+@param offset: The start of the range, an offset in the application area.
+@param size: The size of the range in bytes.
+@return: The set of sector indexes, 0 for the first sector of the application area.
+"""
+def AppSectors(offset, size):
+
+    return {i for i in range(len(APP_SECTOR_BOUNDS) - 1)
+            if offset < APP_SECTOR_BOUNDS[i + 1] and offset + size > APP_SECTOR_BOUNDS[i]}
+
+
+"""
+Function: IndexImage
+Description: Indexes an image by its DELTA_KEY_SIZE bytes sequences, for DiffFrame.
+@param image: The image installed in the application area.
+@return: A dictionary key -> offsets of the image it is found at.
+"""
+def IndexImage(image):
+
+    index = {}
+
+    for offset in range(0, len(image) - DELTA_KEY_SIZE + 1):
+        index.setdefault(image[offset:offset + DELTA_KEY_SIZE], []).append(offset)
+
+    return index
+
+
+"""
+Function: DiffFrame
+Description: Builds the patch rebuilding a frame from the installed application: DELTA_OP_COPY operations
+             for the data found in the installed image, DELTA_OP_INSERT operations for the rest. Only the
+             sectors the download hasn't overwritten yet may be copied from.
+@param old_image: The image installed in the application area.
+@param index: The index of the installed image, from IndexImage.
+@param data: The frame payload.
+@param frame_offset: The offset of the frame in the application area.
+@param lost_sectors: The sectors of the application area written by the frames sent before this one.
+@return: The patch.
+"""
+def DiffFrame(old_image, index, data, frame_offset, lost_sectors):
+
+    patch = bytearray()
+    literal_start = 0
+    pos = 0
+
+    def insert(end):
+        for start in range(literal_start, end, 0xFFFF):
+            length = min(end - start, 0xFFFF)
+            patch.extend(struct.pack('<BH', DELTA_OP_INSERT, length) + data[start:start + length])
+
+    while pos + DELTA_KEY_SIZE <= len(data):
+        best_length, best_offset = 0, 0
+
+        # An edit shifts the code after it, the data is most likely found close to where it was
+        offsets = index.get(data[pos:pos + DELTA_KEY_SIZE], [])
+        closest = bisect.bisect_left(offsets, frame_offset + pos)
+
+        for offset in offsets[max(0, closest - DELTA_CANDIDATES // 2) : closest + DELTA_CANDIDATES // 2]:
+            length = DELTA_KEY_SIZE
+            limit = min(len(data) - pos, len(old_image) - offset)
+
+            while length < limit and old_image[offset + length] == data[pos + length]:
+                length += 1
+
+            if length > best_length and not (AppSectors(offset, length) & lost_sectors):
+                best_length, best_offset = length, offset
+
+        if best_length < DELTA_MIN_COPY:
+            pos += 1
+            continue
+
+        insert(pos)
+        patch.extend(struct.pack('<BHI', DELTA_OP_COPY, best_length, best_offset))
+        pos += best_length
+        literal_start = pos
+
+    insert(len(data))
+    return bytes(patch)
+
+
+"""
+Function: SplitSegments
+Description: Splits an image into the frames of a segmented download. The image is cut into frame size
+             blocks, the blocks left blank (0xFF) are gaps that are neither sent nor programmed, and the
+             blank words ending a block are not sent either.
+@param file_data: The image, its size a multiple of 4.
+@param frame_size: The negotiated frame size.
+@return: A tuple (list of (block, payload), list of (offset, size) of the segments).
+"""
+def SplitSegments(file_data, frame_size):
+
+    frames = []
+    segments = []
+
+    for block in range(0, (len(file_data) + frame_size - 1) // frame_size):
+        payload = file_data[block * frame_size : (block + 1) * frame_size]
+        length = len(payload.rstrip(b'\xFF'))
+        length += (-length) % 4
+
+        if length == 0:
+            continue
+
+        frames.append((block, payload[:length]))
+
+        # A block following its neighbour in full extends its segment
+        if segments and segments[-1][0] + segments[-1][1] == block * frame_size:
+            segments[-1] = (segments[-1][0], segments[-1][1] + length)
+        else:
+            segments.append((block * frame_size, length))
+
+    return frames, segments
+
+
+"""
+Function: SelectSyncBlocks
+Description: Selects the blocks a sync download sends: the blocks whose checksum differs from the one of the
+             installed block. A sector is erased whole before its first write, the bootloader keeps a copy
+             of SYNC_KEPT_SECTOR only, if it fits in its staging area, so every block of another sector
+             written is sent as well.
+@param file_data: The image, its size a multiple of 4.
+@param frame_size: The frame size, also the block size.
+@param hashes: The checksums of the installed blocks.
+@param staging_size: The size of the staging area of the bootloader.
+@return: The set of the blocks to send.
+"""
+def SelectSyncBlocks(file_data, frame_size, hashes, staging_size=STAGING_SIZE):
+
+    count = (len(file_data) + frame_size - 1) // frame_size
+    kept = {SYNC_KEPT_SECTOR} if APP_SECTOR_BOUNDS[SYNC_KEPT_SECTOR + 1] - APP_SECTOR_BOUNDS[SYNC_KEPT_SECTOR] <= staging_size else set()
+    sectors = [AppSectors(block * frame_size, min(frame_size, len(file_data) - block * frame_size)) for block in range(count)]
+
+    blocks = {block for block in range(count)
+              if block >= len(hashes) or hashes[block] != calculateCRC32(file_data[block * frame_size : (block + 1) * frame_size])}
+
+    # A block across a sector bound brings the next sector in, until no new sector is erased
+    while True:
+        erased = set().union(*(sectors[block] for block in blocks)) - kept
+        resent = {block for block in range(count) if sectors[block] & erased} - blocks
+
+        if not resent:
+            return blocks
+
+        blocks |= resent
+
+
+"""
+Function: OpenSession
+Description: Negotiates the frame size used by the following windowed downloads.
+@param serial_port: The serial port object.
+@param max_frame_size: The largest frame size the host wants to use.
+@param LOG: The logging function to display messages.
+@param session_flags: The SESSION_FLAG_* options requested to the bootloader.
+@return: A tuple (frame size, window size, flags, staging size) accepted by the bootloader, None on failure.
+"""
+def OpenSession(serial_port, max_frame_size, LOG, session_flags=0):
+
+    cmd_packet = bytes([CMD_ID_SESSION]) + struct.pack('<HB', max_frame_size, session_flags) + bytes(3)
+
+    LOG("Send " + CMD_NAME_LIST[CMD_ID_SESSION] + " Command")
+
+    try:
+        serial_port.reset_input_buffer()
+        serial_port.write(cmd_packet)
+        response = serial_port.read(CMD_SIZE)
+
+    except serial.SerialException as e:
+        LOG("Serial Exception while sending CMD: " + str(e))
+        return None
+
+    if len(response) == CMD_SIZE and response[0] == CMD_ID_SESSION_INFO:
+        frame_size, window_size, flags, staging_kb = struct.unpack('<HBBH', response[1:7])
+        staging_size = staging_kb * 1024 if staging_kb else STAGING_SIZE      # Reserved, left 0, by the older bootloaders
+        LOG("Session opened, frame size: " + str(frame_size) + ", window: " + str(window_size) + ", flags: 0x{:02X}".format(flags) +
+            ", staging: " + str(staging_size // 1024) + " KB")
+        return frame_size, window_size, flags, staging_size
+
+    LOG("Invalid Response Packet")
+    return None
+
+
+"""
+Function: GetStats
+Description: Reads the performance counters of the last operation run by the bootloader.
+@param serial_port: The serial port object.
+@param LOG: The logging function to display messages.
+@return: A dictionary counter name -> value, None on failure. Counters unknown to the host are named by index.
+"""
+def GetStats(serial_port, LOG):
+
+    try:
+        serial_port.reset_input_buffer()
+        serial_port.write(bytes([CMD_ID_GET_STATS] + [0]*6))
+        response = serial_port.read(RESP_SIZE)
+
+        if len(response) == RESP_SIZE and response[0] == CMD_ID_STATS:
+            count = response[1]
+            values = serial_port.read(count * 4)
+
+            if len(values) == count * 4:
+                values = struct.unpack('<' + str(count) + 'I', values)
+                names = STATS_NAME_LIST + ['counter_' + str(i) for i in range(len(STATS_NAME_LIST), count)]
+                return dict(zip(names, values))
+
+    except serial.SerialException as e:
+        LOG("Serial Exception while sending CMD: " + str(e))
+        return None
+
+    LOG("Invalid Response Packet")
+    return None
+
+
+"""
+Function: GetChecksum
+Description: Asks the bootloader for the checksum of the start of the application area.
+@param serial_port: The serial port object.
+@param size: The size of the area in bytes, a multiple of 4.
+@param engine: CHECKSUM_ENGINE_CPU or CHECKSUM_ENGINE_DMA, what feeds the CRC unit of the bootloader.
+@param LOG: The logging function to display messages.
+@return: The checksum, None on failure.
+"""
+def GetChecksum(serial_port, size, engine, LOG):
+
+    try:
+        serial_port.reset_input_buffer()
+        serial_port.write(bytes([CMD_ID_CHECKSUM]) + struct.pack('<IB', size, engine) + bytes(1))
+        response = serial_port.read(CMD_SIZE)
+
+        if len(response) == CMD_SIZE and response[0] == CMD_ID_CHECKSUM_INFO:
+            return struct.unpack('<I', response[1:5])[0]
+
+    except serial.SerialException as e:
+        LOG("Serial Exception while sending CMD: " + str(e))
+        return None
+
+    LOG("Invalid Response Packet")
+    return None
+
+
+"""
+Function: GetBlockHashes
+Description: Asks the bootloader for the checksum of each block of the start of the application area, the
+             blocks being as large as the frames of the session opened.
+@param serial_port: The serial port object.
+@param size: The size of the area in bytes, a multiple of 4, the last block may be shorter.
+@param LOG: The logging function to display messages.
+@return: The list of the block checksums, None on failure.
+"""
+def GetBlockHashes(serial_port, size, LOG):
+
+    try:
+        serial_port.reset_input_buffer()
+        serial_port.write(bytes([CMD_ID_BLOCK_HASH]) + struct.pack('<I', size) + bytes(2))
+        response = serial_port.read(RESP_SIZE)
+
+        if len(response) == RESP_SIZE and response[0] == CMD_ID_BLOCK_HASH_INFO:
+            count = struct.unpack('<H', response[1:3])[0]
+            values = serial_port.read(count * 4)
+
+            if len(values) == count * 4:
+                return list(struct.unpack('<' + str(count) + 'I', values))
+
+    except serial.SerialException as e:
+        LOG("Serial Exception while sending CMD: " + str(e))
+        return None
+
+    LOG("Invalid Response Packet")
+    return None
+
+
+"""
+Function: GetImageInfo
+Description: Asks the bootloader for the length and the checksum of the installed image, up to its last word
+             not blank. The bootloader computes them once, then answers at once until the application changes.
+@param serial_port: The serial port object.
+@param LOG: The logging function to display messages.
+@return: A tuple (length, checksum), None on failure.
+"""
+def GetImageInfo(serial_port, LOG):
+
+    try:
+        serial_port.reset_input_buffer()
+        serial_port.write(bytes([CMD_ID_GET_IMAGE_INFO] + [0]*6))
+        response = serial_port.read(IMAGE_INFO_SIZE)
+
+        if len(response) == IMAGE_INFO_SIZE and response[0] == CMD_ID_IMAGE_INFO:
+            return struct.unpack('<II', response[1:9])
+
+    except serial.SerialException as e:
+        LOG("Serial Exception while sending CMD: " + str(e))
+        return None
+
+    LOG("Invalid Response Packet")
+    return None
+
+
+"""
+Function: IsImageInstalled
+Description: Tells whether the installed application matches an image, from the image information of the
+             bootloader: both images end with their last word not blank.
+@param serial_port: The serial port object.
+@param file_data: The image, its size a multiple of 4.
+@param LOG: The logging function to display messages.
+@return: True if the image is installed, False otherwise.
+"""
+def IsImageInstalled(serial_port, file_data, LOG):
+
+    length = len(file_data.rstrip(b'\xFF'))
+    length += (-length) % 4
+
+    return length > 0 and GetImageInfo(serial_port, LOG) == (length, calculateCRC32(file_data[:length]))
+
+
+"""
+Function: ReceiveWindowResp
+Description: Receives the response to windowed packets from the bootloader.
+@param serial_port: The serial port object.
+@param LOG: The logging function to display messages.
+@return: A tuple (response id, base, bitmap). The response id is CMD_ID_WIN_ACK, CMD_ID_PACKET_NACK
+         (resend the window from base), CMD_ID_DELTA_NACK (resend frame base without patch), CMD_ID_ERROR
+         or None if nothing valid was received.
+"""
+def ReceiveWindowResp(serial_port, LOG):
+
+    response = serial_port.read(RESP_SIZE)
+
+    if len(response) == RESP_SIZE:
+
+        if response[0] == CMD_ID_WIN_ACK:
+            response += serial_port.read(WIN_ACK_SIZE - RESP_SIZE)
+
+            if len(response) == WIN_ACK_SIZE:
+                base, bitmap = struct.unpack('<HI', response[1:WIN_ACK_SIZE])
+                return CMD_ID_WIN_ACK, base, bitmap
+
+        elif response[0] in (CMD_ID_PACKET_NACK, CMD_ID_DELTA_NACK):
+            return response[0], response[1] + (response[2] << 8), 0
+
+        elif response[0] == CMD_ID_ERROR:
+            LOG("Received Error: " + ERROR_NAME_LIST.get(response[1], hex(response[1])))
+            return CMD_ID_ERROR, 0, 0
+
+    return None, 0, 0
+
+
+"""
+Function: FrameBlockSize
+Description: Size of a frame in zero-copy mode: the header and the payload padded to a whole number of USB packets.
+@param frame_size: The negotiated frame size.
+@return: The padded frame size in bytes.
+"""
+def FrameBlockSize(frame_size):
+
+    return (FRAME_HEADER_SIZE + frame_size + USB_PACKET_SIZE - 1) // USB_PACKET_SIZE * USB_PACKET_SIZE
+
+
+"""
+Function: UploadFlash
+Description: Reads a flash range back from the bootloader and writes it to a file as it arrives. The bootloader
+             streams the range right after acknowledging the command.
+@param serial_port: The serial port object.
+@param address: The start address of the range, a multiple of 4.
+@param size: The size of the range in bytes, a multiple of 4.
+@param path_to_file: The path to the file written.
+@param LOG: The logging function to display messages.
+@return: True if the whole range was written to the file, False otherwise.
+"""
+def UploadFlash(serial_port, address, size, path_to_file, LOG):
+
+    cmd_packet = bytes([CMD_ID_UPLOAD]) + (address - FLASH_BASE_ADDRESS).to_bytes(3, 'little') + size.to_bytes(3, 'little')
+
+    try:
+        if SendCMD(serial_port, cmd_packet, LOG) != CMD_RESP_STATUS_OK:
+            return False
+
+        with open(path_to_file, "wb") as file:
+            received = 0
+
+            while received < size:
+                data = serial_port.read(min(UPLOAD_READ_SIZE, size - received))
+
+                if len(data) == 0:
+                    LOG("Upload timed out after " + str(received) + " bytes")
+                    return False
+
+                file.write(data)
+                received += len(data)
+
+    except (serial.SerialException, IOError) as e:
+        LOG("Error during the upload: " + str(e))
+        return False
+
+    LOG("Uploaded " + str(size) + " bytes from 0x{:08X}".format(address))
+    return True
+
+
+"""
+Function: SendBinaryFileWindowed
+Description: Sends a binary file as CRC protected frames using a sliding window with selective repeat.
+             The frame size is negotiated first. Up to window_size frames are kept in flight. Every
+             acknowledgment carries the first missing frame and a bitmap of the frames received after it.
+             A frame is resent only when a frame transmitted after it has been received, or when the
+             bootloader reports a corrupted frame or a timeout.
+             In staged mode the bootloader buffers the image in RAM and erases the flash only once the
+             data is verified, frames beyond its staging area are requested again with a non-acknowledgment.
+             In zero-copy mode every frame is padded to a whole number of USB packets, so the bootloader
+             receives it in place into the buffer it is programmed from.
+             In segmented mode only the segments of the image are sent, each frame tagged with the block
+             it is written to: the blank gaps of the image are skipped, and the checksum covers the frames
+             sent. The staging area holds contiguous data only, staged downloads send the whole image.
+             With compression every frame is LZSS compressed on its own, and sent compressed only if that
+             makes it shorter. The bootloader decompresses it on arrival.
+             Given the installed image, a frame may be sent as a patch copying data from the installed
+             application instead, if that makes it shorter, see SendBinaryFileDelta. A patch received after a
+             later frame overwrote its source is refused, the frame is then sent again unpatched.
+             Given the blocks to send, only these are sent, the bootloader keeping the other ones, see
+             SendBinaryFileSync.
+@param serial_port: The serial port object used for communication.
+@param path_to_file: The path to the binary file to be sent.
+@param LOG: The logging function to display messages.
+@param frame_size: The frame size requested to the bootloader.
+@param window_size: The number of frames in flight, None to use the largest the bootloader accepts.
+@param session_flags: The SESSION_FLAG_* options requested to the bootloader.
+@param segmented: Send the segments of the image only.
+@param compress: Compress the frames.
+@param installed: The image installed in the application area, None to send no patch.
+@param only_blocks: The blocks to send, the other ones are kept, None to send the whole image.
+@return: True if the firmware was downloaded and verified by the bootloader, False otherwise.
+"""
+def SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size=FRAME_DEFAULT_SIZE, window_size=None, session_flags=0, segmented=True, compress=False, installed=None, only_blocks=None):
+
+    try:
+        file_size, file_data = LoadBinaryFile(path_to_file, 4)
+
+        session = OpenSession(serial_port, frame_size, LOG, session_flags)
+        if session is None:
+            return False
+
+        frame_size, max_window_size, session_flags, staging_size = session
+        window_size = max_window_size if window_size is None else max(1, min(window_size, max_window_size))
+
+        segmented = segmented and not (session_flags & SESSION_FLAG_STAGED)
+
+        # The blocks are sent whole, a blank one may replace a programmed one
+        if only_blocks is not None:
+            segmented = True
+            blocks = [(block, file_data[block * frame_size : (block + 1) * frame_size]) for block in sorted(only_blocks)]
+            segments = [(block * frame_size, len(payload)) for block, payload in blocks]
+        elif segmented:
+            blocks, segments = SplitSegments(file_data, frame_size)
+        else:
+            blocks = [(seq, file_data[seq * frame_size : (seq + 1) * frame_size]) for seq in range((len(file_data) + frame_size - 1) // frame_size)]
+            segments = [(0, len(file_data))]
+
+        total_frames = len(blocks)
+        crc32_value = calculateCRC32(b''.join(payload for _, payload in blocks))
+        download_cmd = CMD_ID_DOWNLOAD_SYNC if only_blocks is not None else (CMD_ID_DOWNLOAD_SEG if segmented else CMD_ID_DOWNLOAD_WIN)
+
+        cmd_packet = bytes([download_cmd]) + struct.pack('<HI', total_frames, crc32_value)
+
+        LOG("")
+        LOG("--------------- Info ---------------")
+        LOG("Orginal file size \t\t\t: " + str(file_size))
+        LOG("Frame size \t\t\t: " + str(frame_size))
+        LOG("Window size \t\t\t: " + str(window_size))
+        LOG("Staged \t\t\t\t: " + str(bool(session_flags & SESSION_FLAG_STAGED)))
+        LOG("Zero-copy \t\t\t: " + str(bool(session_flags & SESSION_FLAG_ZERO_COPY)))
+        LOG("Segments \t\t\t: " + str(len(segments)) + ", " + str(sum(size for _, size in segments)) + " bytes sent")
+        LOG("Total frames to send: " + str(total_frames))
+        LOG("CRC value \t\t\t: 0x{:02X}".format(crc32_value))
+        LOG("-------------------------------------\n")
+
+        index = IndexImage(installed) if installed is not None else None
+        lost_sectors = set()        # Sectors programmed before the frame is patched, it can't copy from them
+        chunk_sectors = set()       # Sectors of the staged chunk, programmed once the chunk is complete
+        chunk_frames = staging_size // frame_size
+        frame_lost = []             # Frame number -> sectors its patch can't copy from
+
+        for seq, (block, payload) in enumerate(blocks):
+            frame_lost.append(set(lost_sectors))
+
+            # A staged chunk reaches flash once all its frames are patched, other frames as they arrive
+            if session_flags & SESSION_FLAG_STAGED:
+                chunk_sectors |= AppSectors(block * frame_size, len(payload))
+                if (seq + 1) % chunk_frames == 0:
+                    lost_sectors |= chunk_sectors
+            else:
+                lost_sectors |= AppSectors(block * frame_size, len(payload))
+
+        def build(seq, delta):
+            block, payload = blocks[seq]
+            encodings = [(0, payload)]
+
+            if compress:
+                encodings.append((FRAME_FLAG_COMPRESSED, CompressLZSS(payload)))
+
+            if delta:
+                encodings.append((FRAME_FLAG_DELTA, DiffFrame(installed, index, payload, block * frame_size, frame_lost[seq])))
+
+            # The shortest encoding is sent, padded to a whole word
+            flags, encoded = min(encodings, key=lambda encoding: len(encoding[1]) + (-len(encoding[1])) % 4)
+
+            if flags != 0 and len(encoded) + (-len(encoded)) % 4 < len(payload):
+                pad = (-len(encoded)) % 4
+                flags |= pad
+                payload = encoded + bytes(pad)
+            else:
+                flags = 0
+
+            # A multi-packet transfer only completes on a short packet, a frame must not end on a packet boundary
+            fill = not (session_flags & SESSION_FLAG_ZERO_COPY) and (FRAME_HEADER_SIZE + len(payload)) % USB_PACKET_SIZE == 0
+            if fill:
+                flags |= FRAME_FLAG_FILL
+
+            header = struct.pack('<BBHHHI', CMD_ID_PACKET, flags, seq, len(payload), block if segmented else 0, calculateCRC32(payload))
+            frame = header + payload
+
+            if fill:
+                frame += b'\xFF' * FRAME_FILL_SIZE
+
+            if session_flags & SESSION_FLAG_ZERO_COPY:
+                frame += b'\xFF' * (FrameBlockSize(frame_size) - len(frame))
+            else:
+                assert len(frame) % USB_PACKET_SIZE != 0, "a frame must end with a short USB packet"
+
+            return frame, len(payload)
+
+        # Build the frames once, resending one costs a single write
+        frames = []
+        sent_size = 0
+        for seq in range(total_frames):
+            frame, length = build(seq, index is not None)
+            frames.append(frame)
+            sent_size += length
+
+        if compress or index is not None:
+            LOG("Encoded to " + str(sent_size) + " bytes")
+
+        if SendCMD(serial_port, cmd_packet, LOG) != CMD_RESP_STATUS_OK:
+            return False
+
+        LOG("Start Downloading ....")
+
+        base = 0                    # First frame not acknowledged yet
+        next_seq = 0                # Next frame never sent
+        received = set()            # Frames received by the bootloader beyond base
+        tx_count = 0                # Transmission counter, orders the frames by time of sending
+        tx_order = {}               # Frame number -> tx_count of its last transmission
+        timeouts = 0
+        resent = 0
+
+        def send(seq):
+            nonlocal tx_count
+            serial_port.write(frames[seq])
+            tx_order[seq] = tx_count
+            tx_count += 1
+
+        while base < total_frames:
+
+            # Fill the window
+            while next_seq < total_frames and next_seq < base + window_size:
+                send(next_seq)
+                next_seq += 1
+
+            resp_id, ack_base, bitmap = ReceiveWindowResp(serial_port, LOG)
+
+            if resp_id == CMD_ID_ERROR:
+                LOG("Download FW Aborted.")
+                return False
+
+            # The patch copies from a sector a frame received before it has overwritten, send the frame as plain data
+            if resp_id == CMD_ID_DELTA_NACK and ack_base < total_frames:
+                LOG("> Resend Frame n°:" + str(ack_base) + " unpatched")
+                frames[ack_base], _ = build(ack_base, False)
+                send(ack_base)
+                resent += 1
+                continue
+
+            if resp_id != CMD_ID_WIN_ACK:
+
+                if resp_id is None:
+                    timeouts += 1
+                    if timeouts > WIN_MAX_TIMEOUTS:
+                        LOG("Acknowledgment timeout, Download FW Aborted.")
+                        return False
+
+                # The bootloader lost or rejected a frame, resend everything still missing
+                LOG("> Resend window from Frame n°:" + str(base))
+                for seq in range(base, next_seq):
+                    if seq not in received:
+                        send(seq)
+                        resent += 1
+                continue
+
+            timeouts = 0
+
+            # Acknowledgments arrive in order, an older one carries no new information
+            if ack_base < base:
+                continue
+
+            base = ack_base
+            received = {ack_base + 1 + i for i in range(32) if bitmap & (1 << i)}
+
+            if not received:
+                continue
+
+            # A hole below a frame that was sent later and has been received is a lost frame
+            newest = max(tx_order[seq] for seq in received)
+
+            for seq in range(base, max(received)):
+                if seq not in received and tx_order[seq] < newest:
+                    LOG("> Resend Frame n°:" + str(seq))
+                    send(seq)
+                    resent += 1
+
+        LOG("All frames acknowledged, " + str(resent) + " resent.")
+
+        # The bootloader acknowledges the command again once the checksum is verified
+        if ReceiveCmdResp(serial_port, download_cmd, LOG) != CMD_RESP_STATUS_OK:
+            LOG("Download FW Aborted.")
+            return False
+
+        LOG("Firmware Successfully Flashed.")
+        return True
+
+    except IOError as e:
+        LOG("Error while sending binary file: " + str(e))
+
+    return False
+
+
+"""
+Function: SendBinaryFileDelta
+Description: Updates the application from the image installed on the board: the frames are sent as patches
+             copying the unchanged data from the installed application wherever that is shorter. The
+             installed application is checked against its image first, with the checksum of the bootloader.
+             If it doesn't match, or if the update fails, the whole image is sent.
+@param serial_port: The serial port object used for communication.
+@param path_to_file: The path to the binary file to be sent.
+@param path_to_installed: The path to the binary file installed on the board.
+@param LOG: The logging function to display messages.
+@param options: The options of SendBinaryFileWindowed.
+@return: True if the firmware was downloaded and verified by the bootloader, False otherwise.
+"""
+def SendBinaryFileDelta(serial_port, path_to_file, path_to_installed, LOG, **options):
+
+    _, installed = LoadBinaryFile(path_to_installed, 4)
+
+    if GetChecksum(serial_port, len(installed), CHECKSUM_ENGINE_CPU, LOG) != calculateCRC32(installed):
+        LOG("The installed application doesn't match its image, sending the whole image")
+        return SendBinaryFileWindowed(serial_port, path_to_file, LOG, **options)
+
+    if SendBinaryFileWindowed(serial_port, path_to_file, LOG, installed=installed, **options):
+        return True
+
+    # The installed application may have been partly overwritten, there is nothing left to patch
+    LOG("Delta update failed, sending the whole image")
+    return SendBinaryFileWindowed(serial_port, path_to_file, LOG, **options)
+
+
+"""
+Function: SendBinaryFileSync
+Description: Updates the application sending only the blocks that changed: the checksum of every installed
+             block is read from the bootloader and compared to the one of the image block, the blocks that
+             differ are sent by a sync download, which keeps the other ones. The whole application is then
+             checked against the image. Nothing is sent if the application already matches the image, which
+             the image information of the bootloader tells at once.
+             If the check fails, in staged mode which can't keep blocks, or if the installed image is longer
+             and its end must be erased, the whole image is sent.
+@param serial_port: The serial port object used for communication.
+@param path_to_file: The path to the binary file to be sent.
+@param LOG: The logging function to display messages.
+@param frame_size: The frame size requested to the bootloader, also the block size.
+@param options: The other options of SendBinaryFileWindowed.
+@return: True if the firmware was downloaded and verified by the bootloader, False otherwise.
+"""
+def SendBinaryFileSync(serial_port, path_to_file, LOG, frame_size=FRAME_DEFAULT_SIZE, **options):
+
+    _, file_data = LoadBinaryFile(path_to_file, 4)
+
+    if IsImageInstalled(serial_port, file_data, LOG):
+        LOG("The application already matches the image, nothing to flash")
+        return True
+
+    # A sync leaves what lies past the last block it sends: the end of a longer installed image is only erased by a full download
+    installed = GetImageInfo(serial_port, LOG)
+
+    if (options.get('session_flags', 0) & SESSION_FLAG_STAGED) or installed is None or installed[0] > len(file_data):
+        return SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size, **options)
+
+    session = OpenSession(serial_port, frame_size, LOG, options.get('session_flags', 0))
+    hashes = None if session is None else GetBlockHashes(serial_port, len(file_data), LOG)
+
+    if hashes is not None:
+        blocks = SelectSyncBlocks(file_data, session[0], hashes, session[3])
+        LOG("Blocks changed: " + str(len(blocks)) + " of " + str(len(hashes)))
+
+        # The blocks not sent are checked along with the ones sent
+        if (not blocks or SendBinaryFileWindowed(serial_port, path_to_file, LOG, session[0], only_blocks=blocks, **options)) and \
+                GetChecksum(serial_port, len(file_data), CHECKSUM_ENGINE_CPU, LOG) == calculateCRC32(file_data):
+            return True
+
+    LOG("Block sync failed, sending the whole image")
+    return SendBinaryFileWindowed(serial_port, path_to_file, LOG, frame_size, **options)
+
+
 """
 Function: calculateCRC32
 Description: Calculates the CRC32 checksum of the given data.